@@ -30,6 +30,16 @@ INLINE u64 __readcr3()
 }
 #endif
 
+// The loader only runs on the boot processor, see mm.h.
+bool mm::LockTable(mm::PageTable&)
+{
+    return false;
+}
+
+void mm::UnlockTable(mm::PageTable&, bool)
+{
+}
+
 static uefi::simple_text_output_protocol* g_con_out;
 static uefi::simple_text_input_protocol* g_con_in;
 static bool g_leaving_boot_services;
@@ -112,6 +122,38 @@ static uefi::status zero_allocate_pages(
     return s;
 }
 
+//
+// UEFI can't allocate with an alignment, so allocate enough to fit an aligned
+// range and give back the pages before and after it.
+//
+static uefi::status zero_allocate_aligned_pages(
+    uefi::memory_type mem_type,
+    uintn pages,
+    uintn alignment,
+    physical_address* memory
+)
+{
+    const auto slack = uefi::size_to_pages(alignment) - 1;
+    physical_address base;
+
+    auto s = g_bs->allocate_pages(uefi::allocation_type::any_pages, mem_type, pages + slack, &base);
+    if (s != uefi::success)
+        return s;
+
+    const auto aligned = (base + alignment - 1) & ~(alignment - 1);
+    const auto head = (aligned - base) / uefi::page_size;
+
+    if (head)
+        g_bs->free_pages(base, head);
+    if (slack - head)
+        g_bs->free_pages(aligned + pages * uefi::page_size, slack - head);
+
+    memzero(( void* )aligned, pages * uefi::page_size);
+    *memory = aligned;
+
+    return uefi::success;
+}
+
 static uefi::status get_protocol(handle h, uefi::guid* protocol, void** interface_, handle image_handle)
 {
     return g_bs->open_protocol(
@@ -423,20 +465,21 @@ extern "C" uefi::status EfiMain(uefi::handle image_handle, uefi::system_table* s
 
     // Allocate kernel page tables
     // TODO - what is a good size for this?
+    // 2 MiB aligned so they can be mapped with large pages.
     static constexpr auto kernel_page_table_pages = uefi::size_to_pages(MiB(16));
     loader_block->page_table_size = kernel_page_table_pages;
 
     efi_check(
-        zero_allocate_pages(
-            uefi::allocation_type::any_pages,
+        zero_allocate_aligned_pages(
             alloc_type,
             loader_block->page_table_size,
+            mm::large_page_size,
             &loader_block->page_table
         )
     );
 
     // Allocate kernel page pool
-    static constexpr auto kernel_page_pool_pages = kva::kernel_pool.PageCount();
+    static constexpr auto kernel_page_pool_pages = SizeToPages(kva::kernel_pool_initial_size);
     loader_block->page_pool_size = kernel_page_pool_pages;
 
     efi_check(
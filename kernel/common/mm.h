@@ -5,6 +5,8 @@
 */
 
 #include "../lib/libc/mem.h"
+#include "../lib/ec/bitmap.h"
+#include "../lib/ec/enums.h"
 
 #include "va.h"
 
@@ -58,9 +60,11 @@ namespace x64
             u64 write_through : 1;
             u64 cache_disable : 1;
             u64 accessed : 1;
-            u64 reserved0 : 6;
+            u64 ignored0 : 1;
+            u64 page_size : 1;
+            u64 ignored1 : 4;
             u64 page_frame_number : 36;
-            u64 reserved1 : 15;
+            u64 reserved : 15;
             u64 execute_disable : 1;
         };
         u64 value;
@@ -122,25 +126,43 @@ namespace x64
     static_assert(sizeof(PageTableEntry) == sizeof(u64));
     using PageTable = PageTableEntry*;
 #pragma pack()
+
+    // Raw entry bits, for code that handles every paging level the same way.
+    static constexpr u64 page_present       = 1ULL << 0;
+    static constexpr u64 page_writable      = 1ULL << 1;
+    static constexpr u64 page_user          = 1ULL << 2;
+    static constexpr u64 page_write_through = 1ULL << 3;
+    static constexpr u64 page_cache_disable = 1ULL << 4;
+    static constexpr u64 page_large         = 1ULL << 7;  // PDPTE/PDE: maps a 1 GiB/2 MiB page
+    static constexpr u64 page_pat           = 1ULL << 7;  // PTE only
+    static constexpr u64 page_global        = 1ULL << 8;
+    static constexpr u64 page_large_pat     = 1ULL << 12; // PDPTE/PDE with page_large only
+    static constexpr u64 page_no_execute    = 1ULL << 63;
+    static constexpr u64 page_address_mask  = 0x000f'ffff'ffff'f000;
 }
 
 namespace mm
 {
-    union PhysicalPage
+    static constexpr size_t large_page_size = MiB(2);
+    static constexpr size_t huge_page_size = GiB(1);
+
+    enum_flags(MapFlag, u32)
     {
-        struct
-        {
-            u8 present : 1;
-            u8 reserved : 7; // to be used in the future
-        };
-        u8 value;
+        None = 0,
+        User = 1 << 0,
+        CacheDisable = 1 << 1,      // PAT2 (UC-)
+        WriteCombining = 1 << 2,    // PAT4 (see x64::LoadPageAttributeTable)
+        SmallPages = 1 << 3,        // Never use 2 MiB or 1 GiB pages
     };
-    static_assert(sizeof(PhysicalPage) == sizeof(u8));
 
     struct PageTable;
-    static size_t AllocatePhysical(PageTable&, paddr_t*);
+    static size_t AllocatePhysicalLocked(PageTable&, paddr_t*, size_t);
 
-    static constexpr size_t max_page_table_pages = (page_size / sizeof(PhysicalPage));
+    // One bit per page, set if the page is in use.
+    using PhysicalPageMap = ec::const_bitmap<u64, page_size / sizeof(u64)>;
+    static_assert(sizeof(PhysicalPageMap) == page_size);
+
+    static constexpr size_t max_page_table_pages = page_size * 8;
 
     // This structure is used to track physical pages in an address space.
     // It is not to be confused with x64::PageTable, which is architecture specific!
@@ -152,61 +174,85 @@ namespace mm
         PageTable(vaddr_t virt_base, paddr_t phys_base, size_t page_count, paddr_t cr3 = 0)
             : pages(page_count), virt(virt_base), phys(phys_base)
         {
-            phys_info[0].present = true;
+            phys_map->set_bit(0);
             if (cr3)
                 root = cr3;
             else
-                AllocatePhysical(*this, &root); // TODO - handle failure
+                AllocatePhysicalLocked(*this, &root, 1); // TODO - handle failure
         }
 
         size_t pages;
         union
         {
             vaddr_t virt;
-            PhysicalPage* phys_info;
+            PhysicalPageMap* phys_map;
         };
         paddr_t phys;
         paddr_t root; // CR3 (currently one page after phys)
+        size_t next_free = 1; // search hint for AllocatePhysical
+        bool huge_pages = false; // 1 GiB pages are supported
+        u16 pcid = 0; // 0 if PCIDs are unsupported or all are in use
+        bool pcid_stale = true; // The PCID may still tag translations of a previous owner
+        bool locked = false; // See LockTable
     };
 
     //
-    // Some of these functions were adapted from
-    // https://github.com/toddsharpe/MetalOS/blob/master/src/arch/x64/PageTables.cpp
+    // The kernel table is changed from every core. Everything below that allocates from the
+    // page map or changes paging structures holds the table's lock, the ...Locked variants
+    // expect the caller to hold it. Lookups don't take it, a split large page is filled in
+    // before it is linked. The kernel and the boot loader each define these.
     //
+    bool LockTable(PageTable& table); // Returns the previous interrupt state
+    void UnlockTable(PageTable& table, bool interrupts);
 
-    static size_t AllocatePhysical(PageTable& table, paddr_t* phys_out)
+    class TableLockGuard
     {
-        for (size_t page = 1 /* Skip ourselves */; page < table.pages; page++)
+    public:
+        TableLockGuard(PageTable& table)
+            : table(table), interrupts(LockTable(table))
         {
-            // Skip present pages
-            if (table.phys_info[page].present)
-                continue;
+        }
 
-            table.phys_info[page].present = true;
-            *phys_out = table.phys + (page * page_size);
+        TableLockGuard(const TableLockGuard&) = delete;
+        TableLockGuard& operator=(const TableLockGuard&) = delete;
 
-            return page;
+        ~TableLockGuard()
+        {
+            UnlockTable(table, interrupts);
         }
 
-        return 0;
-    }
+    private:
+        PageTable& table;
+        bool interrupts;
+    };
+
+    //
+    // Some of these functions were adapted from
+    // https://github.com/toddsharpe/MetalOS/blob/master/src/arch/x64/PageTables.cpp
+    //
 
-    static size_t AllocatePhysical(PageTable& table, paddr_t* phys_out, size_t count)
+    // Allocates count physically contiguous pages and returns the index of the first one.
+    static size_t AllocatePhysicalLocked(PageTable& table, paddr_t* phys_out, size_t count)
     {
-        size_t page = AllocatePhysical(table, phys_out);
-        if (!page)
+        const size_t limit = table.pages < max_page_table_pages ? table.pages : max_page_table_pages;
+
+        const size_t page = table.phys_map->find_clear_run_next_fit(count, table.next_free, limit);
+        if (page == PhysicalPageMap::npos)
             return 0;
 
-        paddr_t tmp;
-        for (size_t i = 1; i < count; i++)
-        {
-            if (!AllocatePhysical(table, &tmp))
-                return 0;
-        }
+        table.phys_map->set_range(page, count);
+        table.next_free = page + count;
+        *phys_out = table.phys + (page * page_size);
 
         return page;
     }
 
+    static size_t AllocatePhysical(PageTable& table, paddr_t* phys_out, size_t count = 1)
+    {
+        TableLockGuard guard(table);
+        return AllocatePhysicalLocked(table, phys_out, count);
+    }
+
     // Converts the physical address of a paging structure within a table to a virtual address
     INLINE vaddr_t GetPoolEntryVa(PageTable& table, paddr_t phys)
     {
@@ -216,139 +262,303 @@ namespace mm
 #define GetPml4Entry(pool, virt) \
     ((( x64::Pml4 )GetPoolEntryVa(pool, pool.root))[VA_PML4_INDEX(virt)])
 
-#define GetPdptEntry(pool, pml4e, virt) \
-    ((( x64::Pdpt )GetPoolEntryVa(pool, pml4e.value & ~page_mask))[VA_PDPT_INDEX(virt)])
-
-#define GetPdEntry(pool, pdpte, virt) \
-    ((( x64::PageDir )GetPoolEntryVa(pool, pdpte.value & ~page_mask))[VA_PD_INDEX(virt)])
-
-#define GetPtEntry(pool, pde, virt) \
-    ((( x64::PageTable )GetPoolEntryVa(pool, pde.value & ~page_mask))[VA_PT_INDEX(virt)])
-
-    static x64::PageTableEntry* GetPresentPte(PageTable& table, vaddr_t virt)
+    INLINE u64* GetChildTable(PageTable& table, u64 entry)
     {
-        const auto pml4e = GetPml4Entry(table, virt);
-        if (pml4e.present)
-        {
-            const auto pdpte = GetPdptEntry(table, pml4e, virt);
-            if (pdpte.present)
-            {
-                const auto pde = GetPdEntry(table, pdpte, virt);
-                if (pde.present)
-                    return &GetPtEntry(table, pde, virt);
-            }
-        }
-
-        return nullptr;
+        return ( u64* )GetPoolEntryVa(table, entry & x64::page_address_mask);
     }
 
-    INLINE bool IsPagePresent(PageTable& table, vaddr_t virt)
+    // Levels are identified by the shift of the VA bits they translate (va_pml4_shift...va_pt_shift).
+    INLINE bool IsLeafEntry(u64 entry, size_t shift)
     {
-        auto pte = GetPresentPte(table, virt);
-        return pte && pte->present;
+        return shift == va_pt_shift || (shift != va_pml4_shift && (entry & x64::page_large));
     }
 
-    INLINE bool UnmapPage(PageTable& table, vaddr_t virt)
+    static u64 GetLeafAttributes(vaddr_t virt, size_t shift, MapFlag flags)
     {
-        auto pte = GetPresentPte(table, virt);
-        if (pte)
-            pte->present = false;
-        return pte;
+        u64 attributes = x64::page_present | x64::page_writable;
+
+        // Kernel mappings are the same in every address space, so keep them in the TLB across CR3 loads.
+        if (( bool )(flags & MapFlag::User))
+            attributes |= x64::page_user;
+        else if (virt >= kernel_half_base)
+            attributes |= x64::page_global;
+        if (( bool )(flags & MapFlag::CacheDisable))
+            attributes |= x64::page_cache_disable;
+        if (( bool )(flags & MapFlag::WriteCombining))
+            attributes |= shift == va_pt_shift ? x64::page_pat : x64::page_large_pat;
+        if (shift != va_pt_shift)
+            attributes |= x64::page_large;
+
+        return attributes;
     }
 
-    static x64::PageTableEntry* MapPage(PageTable& table, vaddr_t virt, paddr_t phys, bool user = false)
+    //
+    // Replaces a 1 GiB or 2 MiB page by a table mapping the same range with the next smaller size.
+    // Flushing the old translation is left to the caller.
+    //
+    static bool SplitLargePage(PageTable& table, u64* entry, size_t shift)
     {
-        if (!IsPageAligned(virt) || !IsPageAligned(phys))
-            return nullptr;
-
         paddr_t physical_entry;
+        if (!AllocatePhysicalLocked(table, &physical_entry, 1))
+            return false;
 
-        auto& pml4e = GetPml4Entry(table, virt);
-        if (!pml4e)
-        {
-            // If this VA indexed a PDPTE that does not exist yet, allocate one from the pool.
-            // It is reused for all other VAs with the same index.
-            if (!AllocatePhysical(table, &physical_entry))
-                return nullptr;
+        const size_t child_shift = shift - 9;
+        const u64 base = *entry & x64::page_address_mask & ~((1ULL << shift) - 1);
+        u64 attributes = *entry & ~x64::page_address_mask;
 
-            pml4e.value = physical_entry; // same as PFN = physical_entry * PAGE_SIZE
-            pml4e.present = true;
-            pml4e.writable = true;
-            pml4e.user_mode = user;
+        // The PAT bit moves when going from a large page to a PTE.
+        if (child_shift == va_pt_shift)
+        {
+            attributes &= ~x64::page_large;
+            if (*entry & x64::page_large_pat)
+                attributes |= x64::page_pat;
+        }
+        else
+        {
+            attributes |= *entry & x64::page_large_pat;
         }
 
-        auto& pdpte = GetPdptEntry(table, pml4e, virt);
-        if (!pdpte)
+        const auto child = ( u64* )GetPoolEntryVa(table, physical_entry);
+        for (size_t i = 0; i <= va_index_mask; i++)
+            child[i] = (base + (i << child_shift)) | attributes;
+
+        *entry = physical_entry | x64::page_present | x64::page_writable | (*entry & x64::page_user);
+        return true;
+    }
+
+    //
+    // Walks down to the entry at the level given by shift.
+    // Missing paging structures are allocated from the pool and larger pages on the way are split.
+    //
+    static u64* GetOrCreateEntry(PageTable& table, vaddr_t virt, size_t shift, bool user)
+    {
+        auto entry = &GetPml4Entry(table, virt).value;
+
+        for (size_t level = va_pml4_shift; level > shift; level -= 9)
         {
-            if (!AllocatePhysical(table, &physical_entry))
+            if (!(*entry & x64::page_present))
+            {
+                // If this VA indexed a table that does not exist yet, allocate one from the pool.
+                // It is reused for all other VAs with the same index.
+                paddr_t physical_entry;
+                if (!AllocatePhysicalLocked(table, &physical_entry, 1))
+                    return nullptr;
+
+                // same as PFN = physical_entry * PAGE_SIZE
+                *entry = physical_entry | x64::page_present | x64::page_writable | (user ? x64::page_user : 0);
+            }
+            else if (IsLeafEntry(*entry, level) && !SplitLargePage(table, entry, level))
+            {
                 return nullptr;
+            }
 
-            pdpte.value = physical_entry;
-            pdpte.present = true;
-            pdpte.writable = true;
-            pdpte.user_mode = user;
+            entry = &GetChildTable(table, *entry)[(virt >> (level - 9)) & va_index_mask];
         }
 
-        auto& pde = GetPdEntry(table, pdpte, virt);
-        if (!pde)
+        return entry;
+    }
+
+    //
+    // Returns the entry that maps virt. For 2 MiB and 1 GiB pages this is the PDE or PDPTE,
+    // which has its PAT bit in a different place. Use GetSmallPte to change a single 4 KiB page.
+    // PTEs are returned even if they are not present.
+    //
+    static x64::PageTableEntry* GetPresentPte(PageTable& table, vaddr_t virt, size_t* mapping_size = nullptr)
+    {
+        auto entry = &GetPml4Entry(table, virt).value;
+
+        for (size_t level = va_pml4_shift;; level -= 9)
         {
-            if (!AllocatePhysical(table, &physical_entry))
+            if (level != va_pt_shift && !(*entry & x64::page_present))
                 return nullptr;
 
-            pde.value = physical_entry;
-            pde.present = true;
-            pde.writable = true;
-            pde.user_mode = user;
+            if (IsLeafEntry(*entry, level))
+            {
+                if (mapping_size)
+                    *mapping_size = 1ULL << level;
+                return ( x64::PageTableEntry* )entry;
+            }
+
+            entry = &GetChildTable(table, *entry)[(virt >> (level - 9)) & va_index_mask];
         }
+    }
 
-        auto* pte = &GetPtEntry(table, pde, virt);
-        pte->value = phys;
-        pte->present = true;
-        pte->writable = true;
-        pte->global = false;
-        pte->user_mode = user;
+    // Like GetPresentPte, but splits a large page containing virt first.
+    static x64::PageTableEntry* GetSmallPteLocked(PageTable& table, vaddr_t virt)
+    {
+        if (!GetPresentPte(table, virt))
+            return nullptr;
 
-        return pte;
+        return ( x64::PageTableEntry* )GetOrCreateEntry(table, virt, va_pt_shift, false);
+    }
+
+    static x64::PageTableEntry* GetSmallPte(PageTable& table, vaddr_t virt)
+    {
+        TableLockGuard guard(table);
+        return GetSmallPteLocked(table, virt);
     }
 
-    static bool MapPages(PageTable& table, vaddr_t virt, paddr_t phys, size_t count)
+    INLINE bool IsPagePresent(PageTable& table, vaddr_t virt)
     {
-        for (vaddr_t page_offset = 0; page_offset < (count * page_size); page_offset += page_size)
+        auto pte = GetPresentPte(table, virt);
+        return pte && pte->present;
+    }
+
+    //
+    // Range operations on existing mappings. Pages are only split if the range doesn't cover them,
+    // and every changed entry is added to tlb (see x64::TlbGather) instead of being flushed here.
+    //
+    template<class TlbGather>
+    static void UpdatePages(PageTable& table, vaddr_t virt, size_t count, TlbGather& tlb, auto&& update)
+    {
+        TableLockGuard guard(table);
+        const vaddr_t end = virt + count * page_size;
+
+        while (virt < end)
         {
-            vaddr_t va = virt + page_offset;
-            paddr_t pa = phys + page_offset;
+            size_t size;
+            auto entry = GetPresentPte(table, virt, &size);
 
-            if (!MapPage(table, va, pa))
-                return false;
+            if (entry && size != page_size && ((virt & (size - 1)) || end - virt < size))
+            {
+                entry = GetSmallPteLocked(table, virt);
+                size = page_size;
+            }
+
+            if (!entry)
+            {
+                // Nothing mapped here, skip to the next page.
+                virt += page_size;
+                continue;
+            }
+
+            if (entry->present)
+            {
+                update(entry);
+                tlb.Add(virt);
+            }
+
+            virt += size;
         }
+    }
 
-        return true;
+    template<class TlbGather>
+    static void UnmapPages(PageTable& table, vaddr_t virt, size_t count, TlbGather& tlb)
+    {
+        UpdatePages(table, virt, count, tlb, [](x64::PageTableEntry* entry) { entry->present = false; });
     }
 
-    // phys_virt is the physical address on input and the virtual address on return (if successful).
-    template<Region rg>
-    static bool MapPagesInRegion(PageTable& table, uptr_t* phys_virt, size_t count)
+    template<class TlbGather>
+    static void ProtectPages(PageTable& table, vaddr_t virt, size_t count, bool writable, TlbGather& tlb)
     {
-        if ((*phys_virt + count * page_size) > rg.End())
-            return false;
+        UpdatePages(table, virt, count, tlb, [writable](x64::PageTableEntry* entry) { entry->writable = writable; });
+    }
+
+    static x64::PageTableEntry* MapPage(PageTable& table, vaddr_t virt, paddr_t phys, bool user = false)
+    {
+        if (!IsPageAligned(virt) || !IsPageAligned(phys))
+            return nullptr;
+
+        TableLockGuard guard(table);
 
-        for (vaddr_t page = rg.base; page < (page + rg.size); page += page_size)
+        auto pte = ( x64::PageTableEntry* )GetOrCreateEntry(table, virt, va_pt_shift, user);
+        if (pte)
+            pte->value = phys | GetLeafAttributes(virt, va_pt_shift, user ? MapFlag::User : MapFlag::None);
+
+        return pte;
+    }
+
+    struct RangeMapping
+    {
+        vaddr_t virt;
+        paddr_t phys;
+        vaddr_t end;
+        size_t max_shift;       // Largest page size allowed
+        u64 table_attributes;   // For new paging structures
+        u64 small_attributes;   // For PTEs
+        u64 large_attributes;   // For 2 MiB and 1 GiB pages
+    };
+
+    //
+    // Maps as much of the range as fits below one paging structure, descending into each
+    // child table only once. Advances virt and phys past everything that was mapped.
+    //
+    static bool MapTableRange(PageTable& table, u64* entries, size_t shift, RangeMapping& m)
+    {
+        const size_t size = 1ULL << shift;
+
+        for (size_t i = (m.virt >> shift) & va_index_mask; i <= va_index_mask && m.virt < m.end; i++)
         {
-            if (IsPagePresent(table, page))
+            auto& entry = entries[i];
+
+            if (shift == va_pt_shift)
+            {
+                entry = m.phys | m.small_attributes;
+                m.virt += size;
+                m.phys += size;
                 continue;
+            }
 
-            // TODO - lookahead
-            // currently we alloc sequentially so it doesn't matter
+            const bool present = entry & x64::page_present;
+            const bool child_table = present && !IsLeafEntry(entry, shift);
 
-            if (MapPages(table, page, *phys_virt, count))
+            // Don't throw away a table that already maps smaller pages here.
+            if (shift <= m.max_shift && !child_table && !((m.virt | m.phys) & (size - 1)) && m.end - m.virt >= size)
             {
-                *phys_virt = page;
-                return true;
+                entry = m.phys | m.large_attributes;
+                m.virt += size;
+                m.phys += size;
+                continue;
             }
 
-            break;
+            if (!present)
+            {
+                // If this VA indexed a table that does not exist yet, allocate one from the pool.
+                // It is reused for all other VAs with the same index.
+                paddr_t physical_entry;
+                if (!AllocatePhysicalLocked(table, &physical_entry, 1))
+                    return false;
+
+                entry = physical_entry | m.table_attributes;
+            }
+            else if (!child_table && !SplitLargePage(table, &entry, shift))
+            {
+                return false;
+            }
+
+            if (!MapTableRange(table, GetChildTable(table, entry), shift - 9, m))
+                return false;
         }
 
-        return false;
+        return true;
+    }
+
+    //
+    // Maps each part of the range with the largest page size that virt and phys are both aligned to.
+    //
+    static bool MapPagesLocked(PageTable& table, vaddr_t virt, paddr_t phys, size_t count, MapFlag flags)
+    {
+        RangeMapping m{
+            .virt = virt,
+            .phys = phys,
+            .end = virt + count * page_size,
+            .max_shift = va_pt_shift,
+            .table_attributes = x64::page_present | x64::page_writable,
+            .small_attributes = GetLeafAttributes(virt, va_pt_shift, flags),
+            .large_attributes = GetLeafAttributes(virt, va_pd_shift, flags),
+        };
+
+        if (!( bool )(flags & MapFlag::SmallPages))
+            m.max_shift = table.huge_pages ? va_pdpt_shift : va_pd_shift;
+        if (( bool )(flags & MapFlag::User))
+            m.table_attributes |= x64::page_user;
+
+        return MapTableRange(table, ( u64* )GetPoolEntryVa(table, table.root), va_pml4_shift, m);
+    }
+
+    static bool MapPages(PageTable& table, vaddr_t virt, paddr_t phys, size_t count, MapFlag flags = MapFlag::None)
+    {
+        TableLockGuard guard(table);
+        return MapPagesLocked(table, virt, phys, count, flags);
     }
 }
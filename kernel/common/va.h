@@ -13,6 +13,9 @@ static constexpr size_t page_size  = 0x1000;
 static constexpr size_t page_mask  = 0xfff;
 static constexpr size_t page_shift = 12;
 
+// Start of the higher half, where the kernel lives.
+static constexpr vaddr_t kernel_half_base = 0xffff'8000'0000'0000;
+
 INLINE constexpr bool IsPageAligned(uptr_t addr)
 {
     return (addr & page_mask) == 0;
@@ -59,15 +62,31 @@ namespace kva
         MiB(64)
     };
 
-    // Kernel pool: 0xffffffff'8a000000 - 0xffffffff'8a100000
+    // Kernel pool: 0xffffffff'8a000000 - 0xffffffff'8c000000
+    // Only the first kernel_pool_initial_size bytes are mapped by the bootloader,
+    // the rest is mapped on demand as the heap grows.
     constexpr Region kernel_pool{
         frame_buffer.End(),
-        MiB(1)
+        MiB(32)
     };
+    constexpr size_t kernel_pool_initial_size = MiB(1);
 
-    // UEFI runtime: 0xffffffff'8a100000 - 0xffffffff'9a100000
-    constexpr Region uefi{
+    // Physical frame database: 0xffffffff'8c000000 - 0xffffffff'ac000000
+    // 16 bytes per frame, so this covers 128 GiB of physical memory.
+    constexpr Region frame_db{
         kernel_pool.End(),
+        MiB(512)
+    };
+
+    // Virtually contiguous allocations: 0xffffffff'ac000000 - 0xffffffff'cc000000
+    constexpr Region vmalloc{
+        frame_db.End(),
+        MiB(512)
+    };
+
+    // UEFI runtime: 0xffffffff'cc000000 - 0xffffffff'dc000000
+    constexpr Region uefi{
+        vmalloc.End(),
         MiB(256)
     };
 }
@@ -1,7 +1,9 @@
 #include <libc/mem.h>
 #include <ec/bitmap.h>
+#include <ec/util.h>
 
 #include "ke.h"
+#include "trace.h"
 #include "../hw/gfx/output.h"
 #include "../hw/serial/serial.h"
 
@@ -26,40 +28,218 @@ namespace ke
     {
         u32 offset;
         u32 blocks;
+        u8 tag; // Index into pool_tags
+        u8 reserved[7];
+    };
+    static_assert(sizeof(Allocation) == 16);
+
+    constexpr auto AlignUp(size_t value, size_t align)
+    {
+        return (value + align - 1) & ~(align - 1);
     };
 
     static constexpr size_t block_size = 32;
+    static constexpr size_t pool_grow_size = KiB(64);
+    static constexpr size_t vmalloc_threshold = KiB(64);
     [[maybe_unused]] static constexpr u8 fresh = 0xaa, poison = 0xcc;
 
+    //
+    // Objects up to max_slab_size are served from power-of-two size classes.
+    // A slab is one pool page: a Slab header, one tag index byte per object
+    // and the objects themselves, packed against the end of the page.
+    // Slab objects have no Allocation header, their slab is found by masking the address.
+    //
+    struct Slab
+    {
+        Slab* prev;
+        Slab* next;
+        void* free_list;
+        u16 size_class;
+        u16 in_use;
+        u16 capacity;
+        u16 objects_offset;
+    };
+
+    struct SlabCache
+    {
+        Slab* partial; // Slabs with at least one free object
+        Slab* spare;   // At most one completely free slab
+    };
+
+    static constexpr size_t min_slab_shift = 4;
+    static constexpr size_t max_slab_size = 1024;
+    static constexpr size_t slab_header_size = AlignUp(sizeof(Slab), 1 << min_slab_shift);
+
+    INLINE constexpr size_t SlabObjectSize(u16 size_class)
+    {
+        return 1ULL << (size_class + min_slab_shift);
+    }
+
+    INLINE u16 GetSizeClass(size_t size)
+    {
+        if (size <= SlabObjectSize(0))
+            return 0;
+        return ( u16 )(64 - __builtin_clzll(size - 1) - min_slab_shift);
+    }
+
+    static_assert(SlabObjectSize(slab_class_count - 1) == max_slab_size);
+
+    INLINE u8* GetSlabTags(Slab* slab)
+    {
+        return ( u8* )slab + slab_header_size;
+    }
+
+    INLINE size_t GetSlabIndex(Slab* slab, void* object)
+    {
+        return (( vaddr_t )object - ( vaddr_t )slab - slab->objects_offset) / SlabObjectSize(slab->size_class);
+    }
+
 #pragma data_seg(".data")
     static ec::const_bitmap<u64, kva::kernel_pool.size / block_size / 64> alloc_map;
+    static ec::const_bitmap<u64, kva::kernel_pool.PageCount() / 64> slab_pages;
+    static SlabCache slab_caches[slab_class_count];
+    static size_t alloc_hint; // Next fit: block search starts after the last allocation
+    static size_t pool_mapped; // Bytes mapped from the start of the pool
+    static mm::PageTable* kernel_table; // Set once the pool can grow
+    static VaAllocator vmalloc_space;
+    static PoolTagStats pool_tags[max_pool_tags]; // Open addressed by tag, index 0 is never a valid tag
+    static size_t pool_tag_count;
+    static size_t slab_live_bytes;
+    static bool pool_tag_dump_pending = false;
+    // Block map, slab caches, pool growth and the tag table layout. Magazines are per core
+    // and only take it to refill or flush, vmalloc_space has a lock of its own and must
+    // not be called with this one held.
+    static SpinLock pool_lock{};
 #pragma data_seg()
 
-    void InitializeAllocator()
+    //
+    // Returns the index of tag in pool_tags, adding it if needed.
+    // Once the table is full new tags are charged to the untagged entry.
+    //
+    static u8 GetPoolTagIndex(PoolTag tag)
     {
-        memzero(alloc_map.data(), alloc_map.size());
-        total_free = kva::kernel_pool.size; // FIXME - This is wrong; it depends on how much is mapped!
+        static_assert(max_pool_tags <= 128, "Tag indices must fit in the spare PTE bits");
+
+        size_t index = (( u32 )(tag * 0x9e3779b1) >> 26) % max_pool_tags;
+        for (size_t probe = 0; probe < max_pool_tags; probe++, index = (index + 1) % max_pool_tags)
+        {
+            if (pool_tags[index].tag == tag)
+                return ( u8 )index;
+
+            if (!pool_tags[index].tag)
+            {
+                SpinLockGuard guard(pool_lock);
+
+                // Another core may have taken the slot in the meantime.
+                if (pool_tags[index].tag && pool_tags[index].tag != tag)
+                    continue;
+
+                if (!pool_tags[index].tag)
+                {
+                    // Keep the last slot for the untagged entry.
+                    if (pool_tag_count == max_pool_tags - 1 && tag != pool_tag::untagged)
+                        break;
+
+                    pool_tags[index].tag = tag;
+                    pool_tag_count++;
+                }
+
+                return ( u8 )index;
+            }
+        }
+
+        return GetPoolTagIndex(pool_tag::untagged);
+    }
+
+    // Slab allocations served from a magazine don't take the pool lock, the counters are atomic.
+    static void ChargePoolTag(u8 index, size_t bytes)
+    {
+        auto& stats = pool_tags[index];
+
+        __atomic_add_fetch(&stats.allocations, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&stats.total_allocations, 1, __ATOMIC_RELAXED);
+        const size_t live = __atomic_add_fetch(&stats.bytes, bytes, __ATOMIC_RELAXED);
+
+        size_t peak = __atomic_load_n(&stats.peak_bytes, __ATOMIC_RELAXED);
+        while (live > peak && !__atomic_compare_exchange_n(&stats.peak_bytes, &peak, live, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            EMPTY_STMT;
+    }
+
+    static void UnchargePoolTag(u8 index, size_t bytes)
+    {
+        auto& stats = pool_tags[index];
+
+        __atomic_sub_fetch(&stats.allocations, 1, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&stats.bytes, bytes, __ATOMIC_RELAXED);
+    }
+
+    void InitializeAllocator(size_t initial_size)
+    {
+        memzero(alloc_map.data(), sizeof alloc_map);
+        memzero(pool_tags, sizeof pool_tags);
+        pool_tag_count = 0;
+        slab_live_bytes = 0;
+        alloc_hint = 0;
+        pool_mapped = initial_size;
+        total_free = initial_size;
         total_used = 0;
         ke::alloc_initialized = true;
     }
 
-    constexpr auto AlignUp(size_t value, size_t align)
+    void EnableAllocatorGrowth(mm::PageTable* table)
     {
-        return (value + align - 1) & ~(align - 1);
-    };
+        // Every virtual allocation is followed by an unmapped guard page.
+        vmalloc_space.Initialize(kva::vmalloc.base, kva::vmalloc.size, page_size);
+        kernel_table = table;
+    }
 
-    void SetAllocationState(Allocation* info, bool allocating)
+    INLINE size_t MappedBlocks()
     {
-        if (allocating)
+        return pool_mapped / block_size;
+    }
+
+    //
+    // Maps at least size more bytes at the end of the pool, with the pool lock held.
+    // Returns false if nothing could be mapped.
+    //
+    static bool GrowPool(size_t size)
+    {
+        if (!kernel_table)
+            return false;
+
+        size = ec::min(AlignUp(ec::max(size, pool_grow_size), page_size), kva::kernel_pool.size - pool_mapped);
+
+        size_t grown = 0;
+        for (; grown < size; grown += page_size)
         {
-            for (size_t i = info->offset; i < (info->offset + info->blocks); i++)
-                alloc_map.set_bit(i);
+            const auto frame = AllocateFrames();
+            if (!frame)
+                break;
+
+            const auto page = kva::kernel_pool.base + pool_mapped + grown;
+            if (!mm::MapPage(*kernel_table, page, frame))
+            {
+                FreeFrames(frame);
+                break;
+            }
+
+            // The initial pool is zeroed by the bootloader, keep it that way for new pages.
+            ZeroPages(( void* )page, 1);
         }
+
+        pool_mapped += grown;
+        total_free += grown;
+
+        DbgPrint("Kernel pool grown by %llu bytes (now %llu)\n", grown, pool_mapped);
+        return grown;
+    }
+
+    void SetAllocationState(Allocation* info, bool allocating)
+    {
+        if (allocating)
+            alloc_map.set_range(info->offset, info->blocks);
         else // Freeing
-        {
-            for (size_t i = info->offset; i < (info->offset + info->blocks); i++)
-                alloc_map.clear_bit(i);
-        }
+            alloc_map.clear_range(info->offset, info->blocks);
     }
 
     void InitMemory(UNUSED void* block, UNUSED size_t size, UNUSED AllocFlag flags)
@@ -67,89 +247,456 @@ namespace ke
         // This can be too aggressive - for example if we want to allocate 112 bytes,
         // alignment will give us 8 extra bytes to memset.
 #ifdef ALLOC_POISON
-        PoisonMemory(block, fresh, size - sizeof(Allocation));
+        PoisonMemory(block, fresh, size);
 #else
         if (!(flags & AllocFlag::Uninitialized))
-            memzero(block, size - sizeof(Allocation));
+            memzero(block, size);
 #endif
     }
 
-    ALLOC_FN void* Allocate(size_t size, AllocFlag flags)
+    //
+    // Reserves one page-aligned page worth of blocks for a slab.
+    // A page spans exactly two bitmap words, so only even word pairs have to be checked.
+    //
+    static void* AllocatePoolPage()
     {
-        DbgPrint("Allocate() - size %llu\n", size);
+        static_assert(page_size / block_size == 2 * alloc_map.bits_per_member);
 
-        size += sizeof(Allocation);
-        size = AlignUp(size, block_size);
+        for (bool grown = false;; grown = true)
+        {
+            for (size_t i = 0; i < MappedBlocks() / alloc_map.bits_per_member; i += 2)
+            {
+                if (alloc_map[i] || alloc_map[i + 1])
+                    continue;
+
+                alloc_map[i] = alloc_map[i + 1] = ec::umax_v<u64>;
+                slab_pages.set_bit(i / 2);
+
+                total_used += page_size;
+                total_free -= page_size;
+
+                return ( void* )(kva::kernel_pool.base + (i / 2) * page_size);
+            }
+
+            if (grown || !GrowPool(page_size))
+                return nullptr;
+        }
+    }
+
+    static void FreePoolPage(void* page)
+    {
+        const auto index = (( vaddr_t )page - kva::kernel_pool.base) / page_size;
+
+        slab_pages.clear_bit(index);
+        alloc_map[index * 2] = alloc_map[index * 2 + 1] = 0;
+
+        total_used -= page_size;
+        total_free += page_size;
+    }
+
+    INLINE Slab* GetSlab(void* object)
+    {
+        return ( Slab* )(( vaddr_t )object & ~page_mask);
+    }
+
+    INLINE bool IsSlabObject(void* object)
+    {
+        return kva::kernel_pool.Contains(( vaddr_t )object)
+            && slab_pages.has_bit((( vaddr_t )object - kva::kernel_pool.base) / page_size);
+    }
+
+    static void LinkSlab(Slab*& head, Slab* slab)
+    {
+        slab->prev = nullptr;
+        slab->next = head;
+        if (head)
+            head->prev = slab;
+        head = slab;
+    }
+
+    static void UnlinkSlab(Slab*& head, Slab* slab)
+    {
+        if (slab->prev)
+            slab->prev->next = slab->next;
+        else
+            head = slab->next;
+        if (slab->next)
+            slab->next->prev = slab->prev;
+        slab->prev = slab->next = nullptr;
+    }
+
+    static Slab* CreateSlab(u16 size_class)
+    {
+        auto slab = ( Slab* )AllocatePoolPage();
+        if (!slab)
+            return nullptr;
+
+        const auto object_size = SlabObjectSize(size_class);
+
+        // Every object needs its size plus one tag byte.
+        // Objects end at the page boundary, which also aligns them to their size.
+        slab->prev = slab->next = nullptr;
+        slab->size_class = size_class;
+        slab->in_use = 0;
+        slab->capacity = ( u16 )((page_size - slab_header_size) / (object_size + 1));
+        slab->objects_offset = ( u16 )(page_size - slab->capacity * object_size);
+
+        auto object = ( vaddr_t )slab + slab->objects_offset;
+
+        // Thread every object onto the free list, first object at the head.
+        slab->free_list = ( void* )object;
+        for (u16 i = 1; i < slab->capacity; i++, object += object_size)
+            *( void** )object = ( void* )(object + object_size);
+        *( void** )object = nullptr;
+
+        DbgPrint("New slab for class %u at 0x%p (%u objects)\n", size_class, slab, slab->capacity);
+
+        return slab;
+    }
 
-        if (size > total_free)
+    // Takes an object off the slab cache without initializing it.
+    static void* SlabTake(u16 size_class)
+    {
+        auto& cache = slab_caches[size_class];
+
+        auto slab = cache.partial;
+        if (!slab)
         {
-            Print("Allocation error (out of memory for size %llu. Free: %llu)\n", size, total_free);
-            Panic(Status::OutOfMemory);
+            // Prefer the cached empty slab over carving a new page out of the pool.
+            slab = cache.spare ? ec::exchange(cache.spare, nullptr) : CreateSlab(size_class);
+            if (!slab)
+                return nullptr;
+            LinkSlab(cache.partial, slab);
         }
 
-        u32 blocks_needed = ( u32 )(size / block_size);
-        u32 free_blocks = 0, first_block = 0;
+        void* object = slab->free_list;
+        slab->free_list = *( void** )object;
+
+        if (++slab->in_use == slab->capacity)
+            UnlinkSlab(cache.partial, slab);
+
+        return object;
+    }
+
+    static void SlabFree(u16 size_class, void* object)
+    {
+        auto& cache = slab_caches[size_class];
+        auto slab = GetSlab(object);
+
+        if (slab->size_class != size_class)
+            Panic(Status::DoubleFree, ( size_t )object, size_class, slab->size_class);
+
+        PoisonMemory(object, poison, SlabObjectSize(size_class));
+
+        *( void** )object = slab->free_list;
+        slab->free_list = object;
+
+        // A full slab is off the partial list, put it back now that it has room again.
+        if (slab->in_use-- == slab->capacity)
+            LinkSlab(cache.partial, slab);
+
+        if (!slab->in_use)
+        {
+            // Keep one empty slab around so alloc/free pairs at a slab boundary
+            // don't bounce pages in and out of the pool.
+            UnlinkSlab(cache.partial, slab);
+            if (cache.spare)
+                FreePoolPage(slab);
+            else
+                cache.spare = slab;
+        }
+    }
+
+    //
+    // The magazine layer sits in front of the slab caches. Allocations and frees
+    // only touch the current core's magazine until it runs empty or full,
+    // then objects are moved to or from the slab caches in batches under the pool lock.
+    // Must be called with interrupts disabled.
+    //
+    static constexpr u32 magazine_batch = magazine_size / 2;
+
+    static void* MagazineAllocate(u16 size_class)
+    {
+        auto& magazine = GetCore()->magazines[size_class];
 
-        for (u64 i = 0; i < alloc_map.size(); i++)
+        if (!magazine.count)
         {
-            if (alloc_map[i] == ec::umax_v<u64>)
+            pool_lock.Acquire();
+            while (magazine.count < magazine_batch)
             {
-                free_blocks = 0;
-                continue;
+                auto object = SlabTake(size_class);
+                if (!object)
+                    break;
+                magazine.objects[magazine.count++] = object;
             }
+            pool_lock.Release();
 
-            for (u64 j = 0; j < alloc_map.bits_per_member; j++)
-            {
-                u64 block = i * alloc_map.bits_per_member + j;
+            if (!magazine.count)
+                return nullptr;
+        }
 
-                // Is this block in use?
-                if (!alloc_map.has_bit(block))
-                {
-                    if (!free_blocks)
-                        first_block = block;
+        return magazine.objects[--magazine.count];
+    }
 
-                    if (++free_blocks == blocks_needed)
-                    {
-                        auto alloc = ( Allocation* )(kva::kernel_pool.base + (first_block * block_size));
-                        alloc->blocks = blocks_needed;
-                        alloc->offset = first_block;
+    static void MagazineFree(u16 size_class, void* object)
+    {
+        auto& magazine = GetCore()->magazines[size_class];
 
-                        DbgPrint("Found suitable block starting at 0x%p\n", alloc);
+        if (magazine.count == magazine_size)
+        {
+            // Give back the oldest half, the newest objects are the most likely to still be cached.
+            pool_lock.Acquire();
+            for (u32 i = 0; i < magazine_batch; i++)
+                SlabFree(size_class, magazine.objects[i]);
+            pool_lock.Release();
+            for (u32 i = magazine_batch; i < magazine_size; i++)
+                magazine.objects[i - magazine_batch] = magazine.objects[i];
+            magazine.count -= magazine_batch;
+        }
 
-                        SetAllocationState(alloc, true);
+        PoisonMemory(object, poison, SlabObjectSize(size_class));
+        magazine.objects[magazine.count++] = object;
+    }
 
-                        // Skip the allocation info when returning to the caller.
-                        void* memory = ( void* )(( vaddr_t )alloc + sizeof(Allocation));
+    static void* SlabAllocate(u16 size_class, u8 tag)
+    {
+        bool prev = x64::DisableInterrupts();
 
-                        InitMemory(memory, size, flags);
+        void* object;
+        if (core_initialized)
+        {
+            object = MagazineAllocate(size_class);
+        }
+        else
+        {
+            pool_lock.Acquire();
+            object = SlabTake(size_class);
+            pool_lock.Release();
+        }
 
-                        DbgPrint("Used: %llu -> %llu\n", total_used, total_used + size);
+        if (object)
+        {
+            auto slab = GetSlab(object);
+            GetSlabTags(slab)[GetSlabIndex(slab, object)] = tag;
+            ChargePoolTag(tag, SlabObjectSize(size_class));
+            __atomic_add_fetch(&slab_live_bytes, SlabObjectSize(size_class), __ATOMIC_RELAXED);
+        }
 
-                        total_used += size;
-                        total_free -= size;
+        if (prev)
+            x64::EnableInterrupts();
+        return object;
+    }
 
-                        return memory;
-                    }
-                }
-                else
-                {
-                    // If it's used and we haven't reached blocks_needed yet, restart the search.
-                    free_blocks = 0;
-                }
+    static void SlabRelease(void* object)
+    {
+        bool prev = x64::DisableInterrupts();
+
+        // Only the slab knows the real size, a magazine must never hold an object of another class.
+        auto slab = GetSlab(object);
+        const u16 size_class = slab->size_class;
+        UnchargePoolTag(GetSlabTags(slab)[GetSlabIndex(slab, object)], SlabObjectSize(size_class));
+        __atomic_sub_fetch(&slab_live_bytes, SlabObjectSize(size_class), __ATOMIC_RELAXED);
+
+        if (core_initialized)
+        {
+            MagazineFree(size_class, object);
+        }
+        else
+        {
+            pool_lock.Acquire();
+            SlabFree(size_class, object);
+            pool_lock.Release();
+        }
+        if (prev)
+            x64::EnableInterrupts();
+    }
+
+    //
+    // Unmaps the pages of a virtual allocation starting at base and frees their frames.
+    // The unmapped guard page after every allocation is where this stops.
+    // The frames are only freed once no core can reach them through its TLB.
+    // The range belongs to the caller, the table's own lock covers the paging structures.
+    //
+    static size_t UnmapVirtual(vaddr_t base)
+    {
+        size_t pages = 0;
+        while (kva::vmalloc.Contains(base + pages * page_size) && mm::IsPagePresent(*kernel_table, base + pages * page_size))
+            pages++;
+
+        x64::TlbGather tlb;
+        mm::UnmapPages(*kernel_table, base, pages, tlb);
+        tlb.Flush();
+
+        ShootdownKernelTlb();
+
+        // The PTEs still hold the frame numbers after being unmapped, the range isn't reused before it is freed.
+        for (size_t i = 0; i < pages; i++)
+            FreeFrames(mm::GetPresentPte(*kernel_table, base + i * page_size)->page_frame_number * page_size);
+
+        return pages;
+    }
+
+    ALLOC_FN void* AllocateVirtual(size_t size, PoolTag tag, AllocFlag flags)
+    {
+        if (!kernel_table || !size)
+            return nullptr;
+
+        const auto pages = SizeToPages(size);
+        const auto tag_index = GetPoolTagIndex(tag);
+
+        const auto base = vmalloc_space.Allocate(pages * page_size);
+        if (!base)
+            return nullptr;
+
+        bool mapped = true;
+        for (size_t i = 0; i < pages && mapped; i++)
+        {
+            const auto frame = AllocateFrames();
+            mapped = frame && mm::MapPage(*kernel_table, base + i * page_size, frame);
+
+            if (frame && !mapped)
+                FreeFrames(frame);
+        }
+
+        // Virtual allocations have no header, the tag index goes in the spare bits of the first PTE.
+        if (mapped)
+            mm::GetSmallPte(*kernel_table, base)->ignored1 = tag_index;
+
+        if (!mapped)
+        {
+            UnmapVirtual(base);
+            vmalloc_space.Free(base, pages * page_size);
+            return nullptr;
+        }
+
+        ChargePoolTag(tag_index, pages * page_size);
+
+        DbgPrint("AllocateVirtual() - %llu pages at 0x%p\n", pages, base);
+
+        // Frames come straight from the frame allocator and are not zeroed.
+        if (!(flags & AllocFlag::Uninitialized))
+            ZeroPages(( void* )base, pages);
+
+        return ( void* )base;
+    }
+
+    void FreeVirtual(void* address)
+    {
+        const auto base = ( vaddr_t )address;
+
+        if (!kva::vmalloc.Contains(base) || !IsPageAligned(base) || !mm::IsPagePresent(*kernel_table, base))
+            Panic(Status::DoubleFree, base);
+
+        const u8 tag_index = mm::GetSmallPte(*kernel_table, base)->ignored1;
+
+        // The range is released with its guard page, overlapping a free extent panics.
+        const auto pages = UnmapVirtual(base);
+        vmalloc_space.Free(base, pages * page_size);
+        UnchargePoolTag(tag_index, pages * page_size);
+    }
+
+    static void* AllocateFromPool(size_t size, PoolTag tag, AllocFlag flags)
+    {
+        DbgPrint("Allocate() - size %llu\n", size);
+
+        // Large allocations don't need to be physically contiguous.
+        // Before the frame allocator is up they still come from the pool.
+        if (size > vmalloc_threshold)
+        {
+            if (auto memory = AllocateVirtual(size, tag, flags))
+                return memory;
+        }
+
+        const auto tag_index = GetPoolTagIndex(tag);
+
+        if (size <= max_slab_size)
+        {
+            const auto size_class = GetSizeClass(size);
+
+            // Fall back to the block allocator if the pool has no page left for a new slab.
+            if (auto object = SlabAllocate(size_class, tag_index))
+            {
+                InitMemory(object, SlabObjectSize(size_class), flags);
+                return object;
             }
         }
 
-        Print("Allocation error (no suitable blocks for size %llu. Free: %llu)\n", size, total_free);
-        Panic(Status::OutOfMemory);
+        size += sizeof(Allocation);
+        size = AlignUp(size, block_size);
+
+        const bool prev = x64::DisableInterrupts();
+        pool_lock.Acquire();
+
+        const u32 blocks_needed = ( u32 )(size / block_size);
+        auto first_block = alloc_map.find_clear_run_next_fit(blocks_needed, alloc_hint, MappedBlocks());
+
+        // Growing by the full size is enough, even if the free run at the end of the pool is shorter.
+        if (first_block == alloc_map.npos && GrowPool(size))
+            first_block = alloc_map.find_clear_run_next_fit(blocks_needed, alloc_hint, MappedBlocks());
+
+        if (first_block == alloc_map.npos)
+        {
+            pool_lock.Release();
+            Print("Allocation error (no suitable blocks for size %llu. Free: %llu)\n", size, total_free);
+            Panic(Status::OutOfMemory);
+        }
+
+        auto alloc = ( Allocation* )(kva::kernel_pool.base + (first_block * block_size));
+        alloc->blocks = blocks_needed;
+        alloc->offset = ( u32 )first_block;
+        alloc->tag = tag_index;
+
+        DbgPrint("Found suitable block starting at 0x%p\n", alloc);
+
+        SetAllocationState(alloc, true);
+        alloc_hint = first_block + blocks_needed;
+
+        DbgPrint("Used: %llu -> %llu\n", total_used, total_used + size);
+
+        total_used += size;
+        total_free -= size;
+
+        pool_lock.Release();
+        if (prev)
+            x64::EnableInterrupts();
+
+        ChargePoolTag(tag_index, size);
+
+        // Skip the allocation info when returning to the caller.
+        void* memory = ( void* )(( vaddr_t )alloc + sizeof(Allocation));
+
+        InitMemory(memory, size - sizeof(Allocation), flags);
+
+        return memory;
+    }
+
+    ALLOC_FN void* Allocate(size_t size, PoolTag tag, AllocFlag flags)
+    {
+        void* memory = AllocateFromPool(size, tag, flags);
+        TRACE(Allocate, tag, ( u64 )memory, size);
+        return memory;
     }
 
     void Free(void* address)
     {
         DbgPrint("Free() - address 0x%p\n", address);
+        TRACE(Free, 0, ( u64 )address);
 
         if (!address)
             return;
 
+        if (kva::vmalloc.Contains(( vaddr_t )address))
+        {
+            FreeVirtual(address);
+            return;
+        }
+
+        if (IsSlabObject(address))
+        {
+            SlabRelease(address);
+            return;
+        }
+
         // Assume that this is the address returned by Allocate()
         // i.e. starting after the allocation info.
         const auto real_address = ( uptr_t )address - sizeof(Allocation);
@@ -160,25 +707,179 @@ namespace ke
         }
 
         DbgPrint("Freeing 0x%p\n", real_address);
-        const auto alloc = ( Allocation* )real_address;
-        SetAllocationState(alloc, false);
+        // Poisoning overwrites the header.
+        auto info = *( Allocation* )real_address;
+        const auto size = info.blocks * block_size;
 
-        const auto size = alloc->blocks * block_size;
-        DbgPrint("Used: %llu -> %llu\n", total_used, total_used - size);
+        PoisonMemory(( void* )real_address, poison, size);
+        UnchargePoolTag(info.tag, size);
 
-        PoisonMemory(( void* )real_address, poison, bytes);
+        SpinLockGuard guard(pool_lock);
+        SetAllocationState(&info, false);
+
+        DbgPrint("Used: %llu -> %llu\n", total_used, total_used - size);
 
         total_used -= size;
         total_free += size;
     }
 
+    void Free(void* address, size_t size)
+    {
+        // Sized deletes skip the block allocator header lookup, the size class still comes
+        // from the slab so a wrong size can't put the object into another class's magazine.
+        if (size <= max_slab_size && IsSlabObject(address))
+        {
+            TRACE(Free, 0, ( u64 )address, size);
+            SlabRelease(address);
+            return;
+        }
+
+        Free(address);
+    }
+
+    bool QueryPoolTag(PoolTag tag, PoolTagStats& stats)
+    {
+        SpinLockGuard guard(pool_lock);
+
+        for (auto& entry : pool_tags)
+        {
+            if (entry.tag == tag)
+            {
+                stats = entry;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    size_t QueryPoolTags(PoolTagStats* stats, size_t max)
+    {
+        SpinLockGuard guard(pool_lock);
+
+        size_t count = 0;
+        for (auto& entry : pool_tags)
+        {
+            if (!entry.tag)
+                continue;
+            if (count < max)
+                stats[count] = entry;
+            count++;
+        }
+
+        return count;
+    }
+
+    PoolUsage QueryPoolUsage()
+    {
+        SpinLockGuard guard(pool_lock);
+
+        // Longest run of clear bits, skipping over whole words where possible.
+        size_t largest = 0, run = 0;
+        for (size_t i = 0; i < MappedBlocks() / alloc_map.bits_per_member; i++)
+        {
+            const auto word = alloc_map[i];
+            if (!word)
+            {
+                run += alloc_map.bits_per_member;
+                continue;
+            }
+
+            for (size_t b = 0; b < alloc_map.bits_per_member; b++)
+            {
+                if (word & (1ULL << b))
+                {
+                    largest = ec::max(largest, run);
+                    run = 0;
+                }
+                else
+                {
+                    run++;
+                }
+            }
+        }
+        largest = ec::max(largest, run);
+
+        size_t slab_count = 0;
+        for (size_t i = 0; i < slab_pages.size(); i++)
+            slab_count += __builtin_popcountll(slab_pages[i]);
+
+        PoolUsage usage = {
+            .free_bytes = total_free,
+            .largest_free = largest * block_size,
+            .fragmentation = total_free ? ( u32 )(100 - largest * block_size * 100 / total_free) : 0,
+            .slab_utilization = slab_count ? ( u32 )(slab_live_bytes * 100 / (slab_count * page_size)) : 0,
+        };
+
+        return usage;
+    }
+
+    static void PrintPoolTags(void (*print)(const char*, ...))
+    {
+        // Printing formats into a stack buffer, don't copy the table as well.
+        for (auto& tag : pool_tags)
+        {
+            if (!tag.tag)
+                continue;
+
+            print(
+                "%c%c%c%c: %u live (%llu total), %llu bytes, peak %llu bytes\n",
+                ( char )tag.tag, ( char )(tag.tag >> 8), ( char )(tag.tag >> 16), ( char )(tag.tag >> 24),
+                tag.allocations,
+                tag.total_allocations,
+                tag.bytes,
+                tag.peak_bytes
+            );
+        }
+
+        const auto usage = QueryPoolUsage();
+        print(
+            "Pool: %llu bytes free, largest free run %llu bytes, %u%% fragmented, slabs %u%% used\n",
+            usage.free_bytes,
+            usage.largest_free,
+            usage.fragmentation,
+            usage.slab_utilization
+        );
+    }
+
+    void DumpPoolTags()
+    {
+        PrintPoolTags(serial::Write);
+    }
+
+    static int PoolTagDumpThread(u64)
+    {
+        DumpPoolTags();
+        pool_tag_dump_pending = false;
+        return 0;
+    }
+
+    void RequestPoolTagDump()
+    {
+        if (ec::exchange(pool_tag_dump_pending, true))
+            return;
+
+        CreateThread(PoolTagDumpThread, 0);
+    }
+
     DEBUG_FN void PrintAllocations()
     {
-        Print("Total used: %llu bytes, free: %llu bytes\n", total_used, total_free);
-        for (size_t i = 0; i < alloc_map.size(); i++)
+        Print("Total used: %llu bytes, free: %llu bytes (pool mapped: %llu bytes)\n", total_used, total_free, pool_mapped);
+        Print("Virtual allocations: %llu bytes (largest free range: %llu bytes)\n",
+            vmalloc_space.GetUsed(), vmalloc_space.GetLargestFree());
+        for (u16 i = 0; i < slab_class_count; i++)
         {
-            if (auto b = alloc_map[i])
-                Print("[%llu]: 0x%llx\n", i, b);
+            size_t partial = 0;
+            for (auto slab = slab_caches[i].partial; slab; slab = slab->next)
+                partial++;
+            Print(
+                "Slab %llu: %llu partial%s, %u in magazine\n",
+                SlabObjectSize(i),
+                partial,
+                slab_caches[i].spare ? " + spare" : "",
+                core_initialized ? GetCore()->magazines[i].count : 0
+            );
         }
+        PrintPoolTags(Print);
     }
 }
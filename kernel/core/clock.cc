@@ -0,0 +1,261 @@
+#include "ke.h"
+#include "../hw/gfx/output.h"
+#include "../hw/timer/timer.h"
+
+namespace ke
+{
+    static constexpr u64 ns_per_second = 1'000'000'000;
+    static constexpr u32 calibration_ms = 10;
+    static constexpr u32 calibration_runs = 3;
+    static constexpr u32 rebase_ticks = 100;
+
+    //
+    // Counter to nanosecond conversion: ns = base_ns + ((count - base_count) * mult >> shift).
+    // The timer interrupt moves the base forward every rebase_ticks so the product stays in
+    // 64 bits, readers retry while the sequence is odd or changed under them.
+    //
+    struct ClockData
+    {
+        u32 sequence;
+        u32 shift;
+        u64 mult;
+        u64 base_count;
+        u64 base_ns;
+        u64 max_delta;  // Largest delta the multiplication handles
+        u64 frequency;
+        u64 (*read)();
+    };
+
+#pragma data_seg(".data")
+    static ClockData clock{};
+    static ClockSource clock_source = ClockSource::Ticks;
+    static u64 tsc_frequency = 0;
+    static u64 last_rebase = 0;
+#pragma data_seg()
+
+    static u64 ReadTicks()
+    {
+        return timer::ticks;
+    }
+
+    static u64 ReadHpet()
+    {
+        return timer::hpet::ReadCounter();
+    }
+
+    static u64 ReadTsc()
+    {
+        return __rdtsc();
+    }
+
+    // Slow path for a delta past max_delta, only when the timer interrupt was held off for long.
+    INLINE u64 CountToNs(u64 delta, u64 frequency)
+    {
+        return delta / frequency * ns_per_second + delta % frequency * ns_per_second / frequency;
+    }
+
+    u64 Now()
+    {
+        u32 sequence;
+        u64 ns;
+
+        do
+        {
+            sequence = __atomic_load_n(&clock.sequence, __ATOMIC_ACQUIRE);
+            if (sequence & 1)
+            {
+                _mm_pause();
+                continue;
+            }
+
+            const u64 delta = clock.read() - clock.base_count;
+            ns = clock.base_ns + (delta <= clock.max_delta ?
+                (delta * clock.mult) >> clock.shift :
+                CountToNs(delta, clock.frequency));
+
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        } while ((sequence & 1) || __atomic_load_n(&clock.sequence, __ATOMIC_RELAXED) != sequence);
+
+        return ns;
+    }
+
+    INLINE void BeginClockWrite()
+    {
+        __atomic_store_n(&clock.sequence, clock.sequence + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+    }
+
+    INLINE void EndClockWrite()
+    {
+        __atomic_store_n(&clock.sequence, clock.sequence + 1, __ATOMIC_RELEASE);
+    }
+
+    void UpdateClock()
+    {
+        // Ticks jump while the tick is stopped.
+        if (timer::ticks - last_rebase < rebase_ticks)
+            return;
+
+        last_rebase = timer::ticks;
+
+        const bool prev = x64::DisableInterrupts();
+        BeginClockWrite();
+
+        const u64 count = clock.read();
+        const u64 delta = count - clock.base_count;
+        clock.base_ns += delta <= clock.max_delta ? (delta * clock.mult) >> clock.shift : CountToNs(delta, clock.frequency);
+        clock.base_count = count;
+
+        EndClockWrite();
+        if (prev)
+            x64::EnableInterrupts();
+    }
+
+    // Switches sources without Now() going backwards.
+    static void SetClockSource(ClockSource source, u64 (*read)(), u64 frequency)
+    {
+        const bool prev = x64::DisableInterrupts();
+        const u64 now = clock.read ? Now() : 0;
+
+        BeginClockWrite();
+
+        // The most precise shift that leaves room for two seconds between rebases.
+        u32 shift = 32;
+        u64 mult;
+        for (;; shift--)
+        {
+            mult = (ns_per_second << shift) / frequency;
+            if (shift == 0 || (mult <= UINT32_MAX && UINT64_MAX / mult >= 2 * frequency))
+                break;
+        }
+
+        clock.shift = shift;
+        clock.mult = mult;
+        clock.max_delta = mult ? UINT64_MAX / mult : UINT64_MAX;
+        clock.frequency = frequency;
+        clock.read = read;
+        clock.base_count = read();
+        clock.base_ns = now;
+        clock_source = source;
+
+        EndClockWrite();
+        if (prev)
+            x64::EnableInterrupts();
+    }
+
+    // A TSC read as close as possible to a reference counter read, SMIs and VM exits make
+    // some pairs far apart, so the tightest of a few wins.
+    template<typename Fn>
+    static u64 ReadTscPair(Fn read_reference, u64& reference)
+    {
+        u64 best = UINT64_MAX, tsc = 0;
+
+        for (int i = 0; i < 5; i++)
+        {
+            const u64 before = __rdtsc();
+            const u64 value = read_reference();
+            const u64 after = __rdtsc();
+
+            if (after - before < best)
+            {
+                best = after - before;
+                tsc = before + (after - before) / 2;
+                reference = value;
+            }
+        }
+
+        return tsc;
+    }
+
+    EARLY static u64 CalibrateWithHpet()
+    {
+        const u64 hpet_frequency = timer::hpet::Frequency();
+        const u64 window = hpet_frequency * calibration_ms / 1000;
+
+        u64 start, end;
+        const u64 tsc_start = ReadTscPair(timer::hpet::ReadCounter, start);
+
+        while (timer::hpet::ReadCounter() - start < window)
+            _mm_pause();
+
+        const u64 tsc_end = ReadTscPair(timer::hpet::ReadCounter, end);
+        return (tsc_end - tsc_start) * hpet_frequency / (end - start);
+    }
+
+    EARLY static u64 CalibrateWithPit()
+    {
+        constexpr u16 count = timer::pit::clock_rate * calibration_ms / 1000;
+
+        timer::pit::StartCountdown(count);
+        const u64 tsc_start = __rdtsc();
+
+        // Bounded in case there is no PIT, port reads take about a microsecond.
+        u32 spins = 0;
+        while (!timer::pit::CountdownDone())
+        {
+            if (++spins == 10'000'000)
+                return 0;
+        }
+
+        return (__rdtsc() - tsc_start) * timer::pit::clock_rate / count;
+    }
+
+    EARLY static u64 CalibrateTsc()
+    {
+        u64 runs[calibration_runs];
+
+        for (auto& run : runs)
+            run = timer::hpet::registers ? CalibrateWithHpet() : CalibrateWithPit();
+
+        // Median of three, one run hit by an SMI doesn't matter.
+        for (u32 i = 0; i < calibration_runs; i++)
+        {
+            for (u32 j = i + 1; j < calibration_runs; j++)
+            {
+                if (runs[j] < runs[i])
+                    ec::swap(runs[i], runs[j]);
+            }
+        }
+
+        return runs[calibration_runs / 2];
+    }
+
+    EARLY void InitializeClock()
+    {
+        const bool prev = x64::DisableInterrupts();
+
+        SetClockSource(ClockSource::Ticks, ReadTicks, timer::hpet::hz);
+
+        if (x64::cpu_info.tsc_supported)
+            tsc_frequency = CalibrateTsc();
+
+        // Without the invariant bit the rate follows P-states and stops in deep C-states.
+        if (tsc_frequency && x64::cpu_info.invariant_tsc)
+        {
+            SetClockSource(ClockSource::Tsc, ReadTsc, tsc_frequency);
+        }
+        else if (timer::hpet::registers)
+        {
+            SetClockSource(ClockSource::Hpet, ReadHpet, timer::hpet::Frequency());
+        }
+
+        if (prev)
+            x64::EnableInterrupts();
+
+        static constexpr const char* names[]{ "timer ticks", "HPET", "TSC" };
+        Print("Clock source: %s, TSC %llu kHz%s\n",
+            names[( u32 )clock_source],
+            tsc_frequency / 1000,
+            x64::cpu_info.invariant_tsc ? " invariant" : "");
+    }
+
+    ClockSource GetClockSource()
+    {
+        return clock_source;
+    }
+
+    u64 GetTscFrequency()
+    {
+        return tsc_frequency;
+    }
+}
@@ -0,0 +1,217 @@
+#include <ec/util.h>
+
+#include "ke.h"
+#include "../hw/gfx/output.h"
+
+//
+// Buddy allocator for physical frames.
+// Free blocks of 2^order frames are kept in one list per order. When a block
+// is freed it is merged with its buddy (the block at pfn ^ 2^order) as long as
+// the buddy is free and of the same order.
+//
+// Physical memory is not mapped in the kernel address space, so the free lists
+// can't be threaded through the frames themselves. Instead there is one Frame
+// entry per page frame in a database mapped at kva::frame_db.
+//
+
+namespace ke
+{
+    enum class FrameState : u8
+    {
+        Reserved = 0,   // Not managed by the allocator
+        Free,           // First frame of a free block
+        Used,           // First frame of an allocated block
+        Tail,           // Any other frame of a block
+    };
+
+    struct Frame
+    {
+        u32 next;
+        u32 prev;
+        u8 order;
+        FrameState state;
+        u16 reserved0;
+        u32 reserved1;
+    };
+    static_assert(sizeof(Frame) == frame_entry_size);
+
+    static constexpr u32 no_frame = ~0U;
+    static constexpr size_t low_memory_frames = MiB(1) / page_size;
+
+#pragma data_seg(".data")
+    static Frame* frames;
+    static size_t frame_count;
+    static u32 free_lists[max_frame_order + 1];
+    static SpinLock frame_lock{};
+#pragma data_seg()
+
+    INLINE constexpr size_t OrderToFrames(size_t order)
+    {
+        return 1ULL << order;
+    }
+
+    static void PushFree(u32 pfn, size_t order)
+    {
+        auto& frame = frames[pfn];
+        frame.state = FrameState::Free;
+        frame.order = order;
+        frame.prev = no_frame;
+        frame.next = free_lists[order];
+
+        if (frame.next != no_frame)
+            frames[frame.next].prev = pfn;
+        free_lists[order] = pfn;
+    }
+
+    static void RemoveFree(u32 pfn, size_t order)
+    {
+        auto& frame = frames[pfn];
+
+        if (frame.prev != no_frame)
+            frames[frame.prev].next = frame.next;
+        else
+            free_lists[order] = frame.next;
+
+        if (frame.next != no_frame)
+            frames[frame.next].prev = frame.prev;
+
+        frame.state = FrameState::Tail;
+    }
+
+    static void ReleaseBlock(u32 pfn, size_t order)
+    {
+        free_frames += OrderToFrames(order);
+
+        while (order < max_frame_order)
+        {
+            const u32 buddy = pfn ^ ( u32 )OrderToFrames(order);
+            if (buddy >= frame_count
+                || frames[buddy].state != FrameState::Free
+                || frames[buddy].order != order)
+                break;
+
+            RemoveFree(buddy, order);
+            frames[pfn].state = FrameState::Tail;
+            pfn &= ~( u32 )OrderToFrames(order);
+            order++;
+        }
+
+        PushFree(pfn, order);
+    }
+
+    size_t GetFrameDatabaseSize(paddr_t highest_address)
+    {
+        const auto count = highest_address / page_size;
+        return SizeToPages(count * sizeof(Frame)) * page_size;
+    }
+
+    //
+    // Adds every frame in [first, end) to the free lists, in the largest
+    // naturally aligned blocks that fit.
+    //
+    static void AddFrames(size_t first, size_t end)
+    {
+        end = ec::min(end, frame_count);
+        first = ec::max(first, low_memory_frames);
+
+        while (first < end)
+        {
+            size_t order = max_frame_order;
+            while (order && ((first & (OrderToFrames(order) - 1)) || first + OrderToFrames(order) > end))
+                order--;
+
+            ReleaseBlock(first, order);
+            first += OrderToFrames(order);
+        }
+    }
+
+    EARLY void InitializeFrameAllocator(PhysicalRange* ranges, size_t count, PhysicalRange database)
+    {
+        frames = ( Frame* )kva::frame_db.base;
+        frame_count = ec::min(database.pages * page_size / sizeof(Frame), ( size_t )no_frame);
+        for (auto& head : free_lists)
+            head = no_frame;
+
+        // Sort by base so overlapping or adjacent ranges can be merged first.
+        for (size_t i = 1; i < count; i++)
+        {
+            for (size_t j = i; j && ranges[j].base < ranges[j - 1].base; j--)
+                ec::swap(ranges[j], ranges[j - 1]);
+        }
+
+        const size_t db_first = database.base / page_size;
+        const size_t db_end = db_first + database.pages;
+
+        for (size_t i = 0; i < count;)
+        {
+            size_t first = ranges[i].base / page_size;
+            size_t end = first + ranges[i].pages;
+
+            for (i++; i < count && ranges[i].base / page_size <= end; i++)
+                end = ec::max(end, ranges[i].base / page_size + ranges[i].pages);
+
+            if (db_first < end && db_end > first)
+            {
+                AddFrames(first, db_first);
+                AddFrames(db_end, end);
+            }
+            else
+            {
+                AddFrames(first, end);
+            }
+        }
+
+        Print("Frame allocator: %llu MiB free (%llu frames tracked)\n", free_frames * page_size / MiB(1), frame_count);
+    }
+
+    paddr_t AllocateFrames(size_t order)
+    {
+        if (order > max_frame_order)
+            return 0;
+
+        SpinLockGuard guard(frame_lock);
+
+        size_t current = order;
+        while (current <= max_frame_order && free_lists[current] == no_frame)
+            current++;
+
+        if (current > max_frame_order)
+            return 0;
+
+        const u32 pfn = free_lists[current];
+        RemoveFree(pfn, current);
+
+        // Split the block, giving back the upper halves until it has the right size.
+        while (current > order)
+        {
+            current--;
+            PushFree(pfn + ( u32 )OrderToFrames(current), current);
+        }
+
+        frames[pfn].state = FrameState::Used;
+        frames[pfn].order = order;
+        free_frames -= OrderToFrames(order);
+
+        return ( paddr_t )pfn * page_size;
+    }
+
+    void FreeFrames(paddr_t address, size_t order)
+    {
+        const auto pfn = address / page_size;
+        if (pfn >= frame_count)
+            Panic(Status::DoubleFree, address, order);
+
+        SpinLockGuard guard(frame_lock);
+
+        if (frames[pfn].state != FrameState::Used || frames[pfn].order != order)
+            Panic(Status::DoubleFree, address, order);
+
+        ReleaseBlock(pfn, order);
+    }
+
+    void FreeFrameRange(paddr_t base, size_t pages)
+    {
+        SpinLockGuard guard(frame_lock);
+        AddFrames(base / page_size, base / page_size + pages);
+    }
+}
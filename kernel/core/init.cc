@@ -1,4 +1,5 @@
-﻿#include <ec/util.h>
+﻿#include <ec/new.h>
+#include <ec/util.h>
 #include <libc/str.h>
 
 #include "../../boot/boot.h"
@@ -13,6 +14,7 @@
 #include "../hw/serial/serial.h"
 #include "../hw/timer/timer.h"
 #include "ke.h"
+#include "trace.h"
 
 static constexpr size_t kernel_stack_size = KiB(4);
 alignas(page_size) volatile u8 kernel_stack[kernel_stack_size];
@@ -47,15 +49,20 @@ DEBUG_FN EARLY static void SerialPrintDescriptors(MemoryMap& m)
     serial::Write("====================\n");
 }
 
+EARLY static bool IsBootDescriptor(const uefi::memory_descriptor* desc)
+{
+    return (desc->type == uefi::memory_type::boot_services_code
+        || desc->type == uefi::memory_type::boot_services_data
+        || desc->type == uefi::memory_type::loader_code)
+        && !(desc->attribute & uefi::memory_attribute::memory_runtime);
+}
+
 EARLY static void ReclaimBootPages(const MemoryMap& m)
 {
     size_t count = 0;
     IterateMemoryDescriptors(m, [&count](uefi::memory_descriptor* desc)
     {
-        if ((desc->type == uefi::memory_type::boot_services_code
-            || desc->type == uefi::memory_type::boot_services_data
-            || desc->type == uefi::memory_type::loader_code)
-            && !(desc->attribute & uefi::memory_attribute::memory_runtime))
+        if (IsBootDescriptor(desc))
         {
             count++;
             desc->type = uefi::memory_type::conventional_memory;
@@ -89,6 +96,89 @@ EARLY static void CoalesceMemoryDescriptors(const MemoryMap& memory_map)
     Print("Coalesced %llu memory descriptors.\n", count);
 }
 
+//
+// Finds room for the frame database. This runs before ReclaimBootPages
+// because only memory that was free from the start is safe to use while the
+// firmware page tables are still live.
+//
+EARLY static ke::PhysicalRange ReserveFrameDatabase(const MemoryMap& memory_map)
+{
+    static constexpr paddr_t max_address = kva::frame_db.size / ke::frame_entry_size * page_size;
+
+    paddr_t highest = 0;
+    IterateMemoryDescriptors(memory_map, [&highest](uefi::memory_descriptor* desc)
+    {
+        if (desc->type == uefi::memory_type::conventional_memory || IsBootDescriptor(desc))
+            highest = ec::max<paddr_t>(highest, desc->physical_start + desc->number_of_pages * page_size);
+    });
+    highest = ec::min(highest, max_address);
+
+    ke::PhysicalRange db{ 0, SizeToPages(ke::GetFrameDatabaseSize(highest)) };
+    IterateMemoryDescriptors(memory_map, [&db](uefi::memory_descriptor* desc)
+    {
+        if (db.base || desc->type != uefi::memory_type::conventional_memory)
+            return;
+
+        paddr_t start = ec::max<paddr_t>(desc->physical_start, MiB(1));
+        const paddr_t end = desc->physical_start + desc->number_of_pages * page_size;
+
+        // Prefer a 2 MiB aligned base so the database can be mapped with large pages.
+        const paddr_t aligned = (start + mm::large_page_size - 1) & ~(mm::large_page_size - 1);
+        if (aligned < end && (end - aligned) / page_size >= db.pages)
+            start = aligned;
+
+        if (start < end && (end - start) / page_size >= db.pages)
+            db.base = start;
+    });
+
+    if (!db.base)
+        ke::Panic(Status::OutOfMemory);
+
+    // Still identity mapped at this point.
+    memzero(( void* )db.base, db.pages * page_size);
+    return db;
+}
+
+// Returns the conventional memory ranges in a heap allocated array.
+EARLY static ke::PhysicalRange* CollectUsableMemory(const MemoryMap& memory_map, size_t& count)
+{
+    count = 0;
+    IterateMemoryDescriptors(memory_map, [&count](uefi::memory_descriptor* desc)
+    {
+        if (desc->type == uefi::memory_type::conventional_memory)
+            count++;
+    });
+
+    auto ranges = new ke::PhysicalRange[count];
+    size_t i = 0;
+    IterateMemoryDescriptors(memory_map, [&ranges, &i](uefi::memory_descriptor* desc)
+    {
+        if (desc->type == uefi::memory_type::conventional_memory)
+            ranges[i++] = { desc->physical_start, desc->number_of_pages };
+    });
+
+    return ranges;
+}
+
+//
+// Finds free pages below 1 MiB for the application processor startup code, 0 if there are none.
+// The frame allocator never hands out low memory, so nothing else uses them.
+//
+EARLY static paddr_t FindTrampolinePages(const ke::PhysicalRange* ranges, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        // Page 0 holds the real mode interrupt table.
+        const paddr_t start = ec::max<paddr_t>(ranges[i].base, page_size);
+        const paddr_t end = ec::min<paddr_t>(ranges[i].base + ranges[i].pages * page_size, MiB(1));
+
+        if (start < end && (end - start) / page_size >= ke::trampoline_pages)
+            return start;
+    }
+
+    return 0;
+}
+
 EARLY static void MapUefiRuntime(const MemoryMap& memory_map, mm::PageTable& table)
 {
     IterateMemoryDescriptors(memory_map, [&table](uefi::memory_descriptor* desc)
@@ -150,15 +240,15 @@ EARLY static void PrintSplash()
     "@@@@@@@@@@@@@@@@@@@@@@@@@@%%@%%%%##+=-.-:+++*%%#@@@@@@@@@@@%%@%%@@@@@@\n");
 }
 
-static void FinalizeKernelMapping(mm::PageTable& table)
+static void FinalizeKernelMapping(mm::PageTable& table, paddr_t kernel_physical)
 {
     auto pe = pe::File::FromImageBase(( void* )kva::kernel_image.base);
+    x64::TlbGather tlb;
 
-    pe.ForEachSection([&table](pe::Section* section) -> bool
+    pe.ForEachSection([&table, &tlb](pe::Section* section) -> bool
     {
         const auto start = kva::kernel_image.base + section->VirtualAddress;
         const auto size = section->Misc.VirtualSize;
-        const auto end = start + size;
 
         char name[pe::section_name_size + 1];
         strlcpy(name, ( const char* )section->Name, pe::section_name_size);
@@ -166,24 +256,23 @@ static void FinalizeKernelMapping(mm::PageTable& table)
         if (section->Characteristics & pe::SectionFlag::Discardable)
         {
             memzero(( void* )start, size);
-            for (auto page = start; page < end; page += page_size)
-            {
-                mm::UnmapPage(table, page);
-                x64::TlbFlushAddress(( void* )page);
-            }
+            mm::UnmapPages(table, start, SizeToPages(size), tlb);
             return true;
         }
 
         if (!(section->Characteristics & pe::SectionFlag::Write))
-        {
-            for (auto page = start; page < end; page += page_size)
-            {
-                auto pte = mm::GetPresentPte(table, page);
-                pte->writable = false;
-                x64::TlbFlushAddress(( void* )page);
-            }
-        }
+            mm::ProtectPages(table, start, SizeToPages(size), false, tlb);
+
+        return true;
+    });
+
+    tlb.Flush();
 
+    // Only hand the discarded frames out once nothing can still reach them through the TLB.
+    pe.ForEachSection([kernel_physical](pe::Section* section) -> bool
+    {
+        if (section->Characteristics & pe::SectionFlag::Discardable)
+            ke::FreeFrameRange(kernel_physical + section->VirtualAddress, SizeToPages(section->Misc.VirtualSize));
         return true;
     });
 }
@@ -192,17 +281,13 @@ namespace ke
 {
     void InitializeCore(mm::PageTable* page_table)
     {
-        auto core = new Core();
-
-        core->self = core;
-        core->page_table = page_table;
-
-        core->gdt = x64::gdt.data();
-        core->idt = x64::idt.data();
-        core->tss = &x64::kernel_tss;
+        auto core = CreateCore(page_table, x64::gdt.data(), &x64::kernel_tss);
+        core->online = true;
+        cores[0] = core;
 
         WriteMsr(x64::Msr::KERNEL_GS_BASE, ( uptr_t )core);
         _writegsbase_u64(( uptr_t )core);
+        core_initialized = true;
     }
 }
 
@@ -247,7 +332,7 @@ int test4(u64 i)
     auto id = ke::GetCurrentThread()->id;
     while (i-- > 0)
     {
-        Print("Hello from thread %llu (%d)\n", id, i);
+        Print("Hello from thread %llu on core %u (%d)\n", id, ke::GetCore()->index, i);
         ke::Delay(250);
     }
     if (id == 8)
@@ -264,10 +349,45 @@ int test4(u64 i)
     return 4;
 }
 
+// The same test-and-test-and-set as ke::SpinLock, held with interrupts disabled.
+bool mm::LockTable(mm::PageTable& table)
+{
+    const bool prev = x64::DisableInterrupts();
+
+    while (__atomic_exchange_n(&table.locked, true, __ATOMIC_ACQUIRE))
+    {
+        while (__atomic_load_n(&table.locked, __ATOMIC_RELAXED))
+            _mm_pause();
+    }
+
+    return prev;
+}
+
+void mm::UnlockTable(mm::PageTable& table, bool interrupts)
+{
+    __atomic_store_n(&table.locked, false, __ATOMIC_RELEASE);
+    if (interrupts)
+        x64::EnableInterrupts();
+}
+
+//
+// Maps physical memory into a range taken from the given VA allocator.
+// Replaces the physical address with the virtual one, keeping the offset into the page.
+//
+static void MapFromSpace(mm::PageTable* page_table, ke::VaAllocator& space, uptr_t* phys_virt, size_t page_count, mm::MapFlag flags)
+{
+    const auto offset = *phys_virt & (page_size - 1);
+    const auto virt = space.Allocate(page_count * page_size);
+
+    if (!virt || !mm::MapPages(*page_table, virt, *phys_virt - offset, page_count, flags))
+        ke::Panic(Status::OutOfMemory, *phys_virt, page_count);
+
+    *phys_virt = virt + offset;
+}
+
 static void MapDeviceUncached(mm::PageTable* page_table, uptr_t* phys_virt, size_t page_count = 1)
 {
-    mm::MapPagesInRegion<kva::devices>(*page_table, phys_virt, page_count);
-    mm::GetPresentPte(*page_table, *phys_virt)->cache_disable = true;
+    MapFromSpace(page_table, ke::device_space, phys_virt, page_count, mm::MapFlag::CacheDisable);
 }
 
 EXTERN_C NO_RETURN void OsInitialize(LoaderBlock* loader_block)
@@ -285,6 +405,8 @@ EXTERN_C NO_RETURN void OsInitialize(LoaderBlock* loader_block)
     const auto pp_physical = loader_block->page_pool;
     const auto pp_pages = loader_block->page_pool_size;
 
+    const auto frame_db = ReserveFrameDatabase(memory_map);
+
     ReclaimBootPages(memory_map);
     CoalesceMemoryDescriptors(memory_map);
 
@@ -292,15 +414,25 @@ EXTERN_C NO_RETURN void OsInitialize(LoaderBlock* loader_block)
 
     x64::cpu_info.using_apic = false; // HACK until finished
     x64::Initialize(kernel_stack_top);
+    ke::InitializeSimd();
 
     // Init COM ports so we have early debugging capabilities.
     serial::Initialize();
 
     // From here on we can use the heap.
-    ke::InitializeAllocator();
+    ke::InitializeAllocator(pp_pages * page_size);
+
+    // Device mappings are separated by an unmapped page so overruns fault.
+    ke::device_space.Initialize(kva::devices.base, kva::devices.size, page_size);
+    ke::frame_buffer_space.Initialize(kva::frame_buffer.base, kva::frame_buffer.size);
+
+    // The memory map is not mapped anymore after switching page tables
+    size_t usable_count;
+    auto usable_ranges = CollectUsableMemory(memory_map, usable_count);
 
     // Build a new page table (the bootloader one is temporary)
-    auto table = new mm::PageTable(kva::kernel_pt.base, pt_physical, pt_pages);
+    auto table = new (ke::pool_tag::page_table) mm::PageTable(kva::kernel_pt.base, pt_physical, pt_pages);
+    table->huge_pages = x64::cpu_info.huge_pages_supported;
 
     const auto kernel_pages = SizeToPages(kernel.size);
     UNUSED const auto frame_buffer_pages = SizeToPages(display.frame_buffer_size);
@@ -309,11 +441,14 @@ EXTERN_C NO_RETURN void OsInitialize(LoaderBlock* loader_block)
     mm::MapPages(*table, kva::kernel_pt.base, pt_physical, pt_pages);
 
     // turns out vbox page faults at fb base + 0x3000000 when we reach the end so just map the whole range
-    mm::MapPagesInRegion<kva::frame_buffer>(*table, &display.frame_buffer, kva::frame_buffer.PageCount());
-
     // Map the framebuffer as write combining (PAT4)
-    for (auto page = kva::frame_buffer.base; page < kva::frame_buffer.End(); page += page_size)
-        mm::GetPresentPte(*table, page)->pat = true;
+    MapFromSpace(
+        table,
+        ke::frame_buffer_space,
+        &display.frame_buffer,
+        kva::frame_buffer.PageCount(),
+        mm::MapFlag::WriteCombining
+    );
 
     // Map devices with CD bit set in PTE
     MapDeviceUncached(table, &hpet);
@@ -323,11 +458,30 @@ EXTERN_C NO_RETURN void OsInitialize(LoaderBlock* loader_block)
     MapUefiRuntime(memory_map, *table);
 
     mm::MapPages(*table, kva::kernel_pool.base, pp_physical, pp_pages);
+    mm::MapPages(*table, kva::frame_db.base, frame_db.base, frame_db.pages);
 
-    __writecr3(table->root);
+    table->pcid = x64::AllocatePcid();
+    ke::LoadAddressSpace(*table);
+
+    // The bootloader's higher half mappings were global and survive the CR3 load.
+    x64::TlbFlushAll();
     gfx::SetFrameBufferAddress(display.frame_buffer);
 
+    ke::InitializeFrameAllocator(usable_ranges, usable_count, frame_db);
+
+    auto trampoline = FindTrampolinePages(usable_ranges, usable_count);
+    auto trampoline_va = trampoline;
+    if (trampoline)
+        MapFromSpace(table, ke::device_space, &trampoline_va, ke::trampoline_pages, mm::MapFlag::None);
+
+    delete[] usable_ranges;
+
+    // The heap can map new pages from here on.
+    ke::EnableAllocatorGrowth(table);
+    gfx::EnableConsoleShadow();
+
     timer::Initialize(hpet);
+    ke::InitializeClock();
 
     if (i8042)
         ps2::Initialize();
@@ -338,13 +492,18 @@ EXTERN_C NO_RETURN void OsInitialize(LoaderBlock* loader_block)
 
     // Now that kernel init has completed, zero out discardable sections
     // and write-protect every section not marked writable.
-    FinalizeKernelMapping(*table);
+    FinalizeKernelMapping(*table, kernel.physical_base);
 
     ke::InitializeCore(table);
+    ke::InitializeTrace();
 
     x64::unmask_interrupts();
 
     ke::StartScheduler();
+    gfx::StartLogThread();
+
+    // After the log thread, so it stays on the boot processor.
+    ke::StartProcessors(trampoline, trampoline_va);
 
     //ke::CreateThread(test, 0);
     //ke::CreateThread(test2, 0);
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <base.h>
+#include <ec/avl.h>
 #include <ec/list.h>
 
 #include "../common/mm.h"
@@ -21,6 +22,44 @@ namespace ke
     using tid_t = u64;
     using ThreadStartFunction = int(*)(u64);
 
+    struct Core;
+    struct Timer;
+    struct TimerWheel;
+    using TimerCallback = void(*)(Timer* timer, u64 arg);
+
+    //
+    // One-shot callback at a tick, called from the timer interrupt with interrupts disabled.
+    // The owner keeps the memory valid until the timer fired or was cancelled.
+    // A timer fires on the core that armed it, any core may cancel or re-arm it.
+    //
+    struct Timer
+    {
+        Timer* next;
+        Timer** pprev;  // Link pointing at this timer, null while not armed
+        u64 expires;    // Tick
+        TimerCallback callback;
+        u64 arg;
+        u32 slot;       // Wheel level * wheel_slots + slot index
+        TimerWheel* wheel; // Last wheel it was armed on, locking it guards pprev
+    };
+
+    static constexpr u32 priority_count = 32;
+    static constexpr u8 default_priority = 16;
+    static constexpr u32 default_time_slice = 10; // Ticks
+
+    enum class SchedPolicy : u8
+    {
+        Fixed,  // Runs before every fair thread, highest priority first and FIFO within one
+        Fair,   // Shares the CPU by weight, the priority picks the weight
+    };
+
+    struct SchedParams
+    {
+        SchedPolicy policy = SchedPolicy::Fair;
+        u8 priority = default_priority;         // Below priority_count, higher is more important
+        u32 time_slice = default_time_slice;    // Ticks, 0 runs until the thread blocks or yields
+    };
+
     struct Thread
     {
         constexpr Thread() = default;
@@ -34,29 +73,142 @@ namespace ke
             Terminating,
         };
 
-        ec::slist_entry thread_list_entry;
+        ec::list_entry thread_list_entry;
+        ec::list_entry run_entry; // On a fixed run queue while Ready
+        ec::avl_entry<Thread> fair_entry; // On the fair run queue while Ready, see RunQueues
         x64::Context context;
         uptr_t user_stack;
         uptr_t user_stack_top;
         uptr_t kernel_stack_top;
         State state;
-        u64 delay;
+        Timer wait_timer; // Ends Delay
+        SchedParams sched;
+        u32 slice_left;   // Ticks
+        u64 vruntime;     // Weighted nanoseconds run, fair threads only
+        u64 exec_start;   // ke::Now() when the thread was last charged
+        Core* core;       // Threads stay on the core they were placed on
         ThreadStartFunction function;
         u64 arg;
         tid_t id;
+        void* fpu_state; // Allocated on first use of the FPU
+    };
+
+    static constexpr u16 slab_class_count = 7; // 16, 32, ..., 1024
+    static constexpr u32 magazine_size = 32;
+
+    //
+    // Per-core stack of free slab objects of one size class.
+    // It is refilled from and flushed to the slab caches half a magazine at a time.
+    //
+    struct Magazine
+    {
+        u32 count;
+        void* objects[magazine_size];
+    };
+
+    //
+    // Ready threads of one core, see sched.cc. The running thread and waiting
+    // threads are not queued, so picking the next thread doesn't depend on how
+    // many threads sleep.
+    //
+    struct RunQueues
+    {
+        u32 fixed_ready;                    // Bit per non-empty fixed priority queue
+        ec::list_entry fixed[priority_count];
+        Thread* fair;                       // AVL tree ordered by vruntime
+        Thread* fair_first;                 // Its leftmost thread, the next to run
+        u64 min_vruntime;                   // Never decreases, new and woken threads start near it
+
+        INLINE void init()
+        {
+            for (auto& queue : fixed)
+                queue.init();
+        }
+    };
+
+    INLINE Thread* RunQueueThread(ec::list_entry* entry)
+    {
+        return entry ? CONTAINING_RECORD(entry, Thread, run_entry) : nullptr;
+    }
+
+    //
+    // Test-and-test-and-set lock for data shared between cores.
+    // It is held with interrupts disabled, an interrupt handler taking a lock the
+    // interrupted code holds would spin forever. Locks don't nest unless noted.
+    //
+    struct SpinLock
+    {
+        INLINE void Acquire()
+        {
+            while (__atomic_exchange_n(&locked, true, __ATOMIC_ACQUIRE))
+            {
+                while (__atomic_load_n(&locked, __ATOMIC_RELAXED))
+                    _mm_pause();
+            }
+        }
+
+        INLINE void Release()
+        {
+            __atomic_store_n(&locked, false, __ATOMIC_RELEASE);
+        }
+
+        bool locked = false;
     };
 
+    // Disables interrupts and holds the lock until the end of the scope.
+    class SpinLockGuard
+    {
+    public:
+        SpinLockGuard(SpinLock& spin_lock)
+            : lock(spin_lock), prev(x64::DisableInterrupts())
+        {
+            lock.Acquire();
+        }
+
+        SpinLockGuard(const SpinLockGuard&) = delete;
+        SpinLockGuard& operator=(const SpinLockGuard&) = delete;
+
+        ~SpinLockGuard()
+        {
+            lock.Release();
+            if (prev)
+                x64::EnableInterrupts();
+        }
+
+    private:
+        SpinLock& lock;
+        bool prev;
+    };
+
+    static constexpr u32 wheel_levels = 4;
+    static constexpr u32 wheel_slot_bits = 6;
+    static constexpr u32 wheel_slots = 1 << wheel_slot_bits;
+
+    //
+    // Hierarchical timing wheel, see timers.cc.
+    // Level n slots are 64^n ticks wide, the four levels reach about 4.6 hours ahead.
+    //
+    struct TimerWheel
+    {
+        SpinLock lock;                  // Other cores cancel and re-arm timers armed here
+        u64 time;                       // Next tick to expire
+        u64 occupied[wheel_levels];     // Bit per non-empty slot
+        Timer* slots[wheel_levels][wheel_slots];
+    };
+
+    struct TraceRecord;
+
     //
     // This is like the KPRCB on Windows.
     // It contains per-core kernel data and is stored in GS.
-    // The kernel only supports one core right now so this only exists once.
+    // There is one per core, the boot core's is cores[0].
     //
     struct Core
     {
         Core* self; // avoid having to rdgsbase
         Thread* current_thread;
         Thread* idle_thread;
-        ec::slist_entry thread_list_head;
+        Thread* fpu_owner; // Thread whose state is in the FPU registers
         mm::PageTable* page_table;
         uptr_t kernel_stack;
         uptr_t user_stack;
@@ -65,15 +217,41 @@ namespace ke
         const x64::IdtEntry* idt;
         x64::Tss* tss;
 
-        INLINE auto GetFirstThread()
-        {
-            return this->thread_list_head.m_next;
-        }
+        ec::list_entry thread_list; // Every thread but the idle thread
+        Magazine magazines[slab_class_count];
+        u32 preempt_count; // The timer doesn't switch threads while this is non-zero
+        bool kernel_fpu_active;
+        TraceRecord* trace_buffer; // See trace.h
+        u32 trace_head;
+        RunQueues run_queues;
+        bool need_resched; // Switch threads on the next interrupt
+        TimerWheel timer_wheel;
+        bool tick_stopped;  // The idle core waits for a single timer interrupt, see timer::StopTick
+
+        SpinLock lock;      // Run queues and thread list, other cores queue threads here too
+        u32 index;          // In cores
+        u8 apic_id;
+        bool online;
+        u32 thread_count;   // Threads placed here, the idle thread not included
+        u64 tlb_requests;   // Kernel TLB flushes other cores asked for, see ShootdownKernelTlb
+        u64 tlb_done;       // Requests the last flush covered
+        bool tlb_nmi_sent;  // An NMI for tlb_requests is on its way
+        ec::list_entry exited_threads; // Still on their stacks until the next thread switch
     };
     static_assert(OFFSET(Core, kernel_stack) == 40, "Update cpu.asm!");
     static_assert(OFFSET(Core, user_stack) == 48, "Update cpu.asm!");
 
-    void InitializeCore();
+    void InitializeCore(mm::PageTable* page_table);
+
+    //
+    // Switches to the address space of table. A PCID that might still tag
+    // translations from a previous owner is flushed on its first load.
+    //
+    INLINE void LoadAddressSpace(mm::PageTable& table)
+    {
+        const bool flush = !table.pcid || ec::exchange(table.pcid_stale, false);
+        x64::LoadCr3(table.root, table.pcid, flush);
+    }
 
     INLINE Core* GetCore()
     {
@@ -87,31 +265,172 @@ namespace ke
 
 #pragma data_seg(".data")
     inline bool schedule = false;
+    inline bool core_initialized = false; // GS points to a valid Core
+    inline Core* cores[x64::max_cores]{};
+    inline u32 core_count = 1; // Online, they are the first core_count entries of cores
 #pragma data_seg()
 
+    // Pages below 1 MiB for the application processor startup code and its page table.
+    static constexpr size_t trampoline_pages = 4;
+
+    // Per-core data for the core using gdt and tss, without an idle thread and not yet in cores.
+    Core* CreateCore(mm::PageTable* page_table, const x64::GdtEntry* gdt, x64::Tss* tss);
+    // Starts the other cores with a trampoline at physical address trampoline, mapped at trampoline_va.
+    void StartProcessors(paddr_t trampoline, vaddr_t trampoline_va);
+    // After unmapping kernel pages, makes the other cores drop their translations.
+    // The request is an NMI, so this works with interrupts disabled and locks held.
+    void ShootdownKernelTlb();
+    // From the NMI handler, false if no shootdown was pending.
+    bool HandleTlbShootdown();
+
     Thread* CreateThread(ThreadStartFunction function, u64 arg, vaddr_t kstack = 0);
-    Thread* CreateThreadInternal(ThreadStartFunction function, u64 arg, vaddr_t kstack);
+    Thread* CreateThread(ThreadStartFunction function, u64 arg, const SchedParams& params, vaddr_t kstack = 0);
+    Thread* CreateThreadInternal(ThreadStartFunction function, u64 arg, vaddr_t kstack, const SchedParams& params = {});
+    Thread* CreateIdleThread(Core* core, vaddr_t kstack);
     void CreateUserThread(void* user_function);
 
     bool SelectNextThread();
     void StartScheduler();
 
+    // Queues a new or woken thread on its core, and asks for a switch if it should preempt the running one.
+    void ReadyThread(Thread* thread);
+    // Puts prev back unless it stopped running and makes the thread to run next current, prev included.
+    Thread* PickReadyThread(Core* core, Thread* prev);
+    // From the timer interrupt, charges the running thread and ends its time slice.
+    void SchedulerTick();
+
+    // Arms or re-arms a timer. Expiry times in the past fire on the next tick.
+    void SetTimer(Timer* timer, u64 expires, TimerCallback callback, u64 arg = 0);
+    // False if the timer wasn't armed.
+    bool CancelTimer(Timer* timer);
+    // From the timer interrupt.
+    void ExpireTimers();
+    // Earliest armed expiry, ~0 if there is none.
+    u64 NextTimerExpiry();
+
+    void HandleFpuTrap();
+
+    //
+    // Lets kernel code use vector registers, only in files built with SIMD flags.
+    // The current owner's state is saved first and preemption is disabled until the end.
+    // Sections don't nest: KernelFpuBegin fails inside another section (e.g. in an
+    // interrupt handler) and before the core is set up, callers need a scalar fallback.
+    // Nothing in a section may block or yield.
+    //
+    bool KernelFpuBegin();
+    void KernelFpuEnd();
+
+    class KernelFpuGuard
+    {
+    public:
+        KernelFpuGuard() : acquired(KernelFpuBegin()) {}
+        KernelFpuGuard(const KernelFpuGuard&) = delete;
+        KernelFpuGuard& operator=(const KernelFpuGuard&) = delete;
+
+        ~KernelFpuGuard()
+        {
+            if (acquired)
+                KernelFpuEnd();
+        }
+
+        explicit operator bool() const { return acquired; }
+
+    private:
+        bool acquired;
+    };
+
+    // Vector implementations where the CPU has them, see simd.cc.
+    EARLY void InitializeSimd();
+    void CopyMemory(void* dst, const void* src, size_t n);
+    void ZeroPages(void* dst, size_t pages);
+    // Copies a rectangle with non-temporal stores, meant for write-combining memory.
+    void StreamLines(void* dst, size_t dst_pitch, const void* src, size_t src_pitch, size_t line_size, size_t lines);
+    u32 Crc32c(u32 crc, const void* data, size_t n);
+
     NO_RETURN void ExitThread(int exit_code);
     void Yield();
     void Delay(u64 ticks);
 
+    enum class ClockSource : u8
+    {
+        Ticks,  // Timer interrupts, millisecond resolution
+        Hpet,   // Main counter, when the TSC is unreliable
+        Tsc,    // Calibrated and invariant
+    };
+
+    // Calibrates the TSC and picks a clock source, after timer::Initialize.
+    EARLY void InitializeClock();
+    // From the timer interrupt, keeps the counter to nanosecond conversion in range.
+    void UpdateClock();
+    // Nanoseconds since InitializeClock, monotonic.
+    u64 Now();
+    ClockSource GetClockSource();
+    // Hz, 0 if the TSC could not be calibrated.
+    u64 GetTscFrequency();
+
     enum_flags(AllocFlag, u32)
     {
         None = 0,
         Uninitialized = 1 << 0, // Ignored with ALLOC_POISON
     };
 
+    //
+    // Every allocation is charged to a four character pool tag.
+    // The characters are stored in order so they can be read from memory dumps.
+    //
+    using PoolTag = u32;
+
+    consteval PoolTag MakePoolTag(const char (&name)[5])
+    {
+        return ( u32 )name[0] | ( u32 )name[1] << 8 | ( u32 )name[2] << 16 | ( u32 )name[3] << 24;
+    }
+
+    namespace pool_tag
+    {
+        static constexpr PoolTag untagged = MakePoolTag("None");
+        static constexpr PoolTag thread = MakePoolTag("Thrd");
+        static constexpr PoolTag stack = MakePoolTag("Stck");
+        static constexpr PoolTag string = MakePoolTag("Strg");
+        static constexpr PoolTag print = MakePoolTag("Prnt");
+        static constexpr PoolTag core = MakePoolTag("Core");
+        static constexpr PoolTag page_table = MakePoolTag("Ptbl");
+        static constexpr PoolTag va_space = MakePoolTag("Vasp");
+        static constexpr PoolTag fpu = MakePoolTag("Fpu ");
+        static constexpr PoolTag console = MakePoolTag("Cons");
+        static constexpr PoolTag trace = MakePoolTag("Trce");
+    }
+
+    struct PoolTagStats
+    {
+        PoolTag tag;
+        u32 allocations;        // Live allocations
+        u64 total_allocations;  // Including freed ones
+        size_t bytes;           // Live bytes, including allocator rounding
+        size_t peak_bytes;
+    };
+
+    struct PoolUsage
+    {
+        size_t free_bytes;
+        size_t largest_free;    // Largest run of free blocks in the mapped pool
+        u32 fragmentation;      // Percent of free bytes outside the largest run
+        u32 slab_utilization;   // Percent of slab objects in use
+    };
+
+    static constexpr size_t max_pool_tags = 64;
+
     inline bool alloc_initialized = false;
     inline size_t total_free;
     inline size_t total_used;
 
-    void InitializeAllocator();
-    ALLOC_FN void* Allocate(size_t size, AllocFlag flags = AllocFlag::None);
+    void InitializeAllocator(size_t initial_size);
+    void EnableAllocatorGrowth(mm::PageTable* table);
+    ALLOC_FN void* Allocate(size_t size, PoolTag tag, AllocFlag flags = AllocFlag::None);
+
+    ALLOC_FN INLINE void* Allocate(size_t size, AllocFlag flags = AllocFlag::None)
+    {
+        return Allocate(size, pool_tag::untagged, flags);
+    }
 
     template<class T>
     ALLOC_FN INLINE T* Allocate(size_t size = sizeof(T), AllocFlag flags = AllocFlag::None)
@@ -119,9 +438,83 @@ namespace ke
         return ( T* )Allocate(size, flags);
     }
 
+    template<class T>
+    ALLOC_FN INLINE T* Allocate(size_t size, PoolTag tag, AllocFlag flags = AllocFlag::None)
+    {
+        return ( T* )Allocate(size, tag, flags);
+    }
+
     void Free(void* address);
+    void Free(void* address, size_t size);
     DEBUG_FN void PrintAllocations();
 
+    // Returns false if nothing was ever allocated with tag.
+    bool QueryPoolTag(PoolTag tag, PoolTagStats& stats);
+    // Copies up to max entries, returns the number of tags in use.
+    size_t QueryPoolTags(PoolTagStats* stats, size_t max);
+    PoolUsage QueryPoolUsage();
+    // Writes the tag table and pool usage to the serial port. Only from a thread, it waits for the port.
+    void DumpPoolTags();
+    // Dumps from a new thread, usable from interrupt handlers.
+    void RequestPoolTagDump();
+
+    // Page granular, backed by frames that don't have to be contiguous.
+    ALLOC_FN void* AllocateVirtual(size_t size, PoolTag tag, AllocFlag flags = AllocFlag::None);
+    void FreeVirtual(void* address);
+
+    //
+    // Physical frame allocator.
+    // Blocks are 2^order pages, physically contiguous and aligned to their size.
+    //
+    struct PhysicalRange
+    {
+        paddr_t base;
+        size_t pages;
+    };
+
+    static constexpr size_t max_frame_order = 10; // 4 MiB
+    static constexpr size_t frame_entry_size = 16; // bytes per frame in the database
+
+    inline size_t free_frames;
+
+    size_t GetFrameDatabaseSize(paddr_t highest_address);
+    void InitializeFrameAllocator(PhysicalRange* ranges, size_t count, PhysicalRange database);
+    paddr_t AllocateFrames(size_t order = 0);
+    void FreeFrames(paddr_t address, size_t order = 0);
+    void FreeFrameRange(paddr_t base, size_t pages);
+
+    //
+    // Allocates ranges of kernel virtual address space, e.g. for device mappings.
+    // Allocation and free are O(log n) in the number of free extents.
+    // Every allocation is followed by guard bytes that are never handed out.
+    // Extents come from the heap, so the lock is taken before the pool's.
+    //
+    class VaAllocator
+    {
+    public:
+        struct Extent;
+
+        void Initialize(vaddr_t base, size_t size, size_t guard = 0);
+        vaddr_t Allocate(size_t size, size_t alignment = page_size);
+        void Free(vaddr_t address, size_t size);
+        size_t GetLargestFree() const;
+
+        INLINE size_t GetUsed() const { return used; }
+
+    private:
+        Extent* root;
+        vaddr_t region_base;
+        size_t region_size;
+        size_t guard_size;
+        size_t used;
+        SpinLock lock;
+    };
+
+#pragma data_seg(".data")
+    inline VaAllocator device_space;
+    inline VaAllocator frame_buffer_space;
+#pragma data_seg()
+
     NO_RETURN void Panic(Status);
     NO_RETURN void Panic(Status, size_t, size_t = 0, size_t = 0, size_t = 0);
 }
@@ -1,17 +1,21 @@
 #include "ke.h"
 #include "../hw/gfx/output.h"
+#include "../hw/serial/serial.h"
 #include "../hw/cpu/x64.h"
 
 namespace ke
 {
     NO_RETURN void Panic(Status status)
     {
+        gfx::StopLogThread();
         Print("Kernel panic! Status: %d\n", status);
+        serial::Flush();
         x64::Halt();
     }
 
     NO_RETURN void Panic(Status status, size_t p1, size_t p2, size_t p3, size_t p4)
     {
+        gfx::StopLogThread();
         Print(
             "Kernel panic! Status: %d\n"
             "P1: 0x%llx\n"
@@ -21,6 +25,7 @@ namespace ke
             status,
             p1, p2, p3, p4
         );
+        serial::Flush();
         x64::Halt();
     }
 }
@@ -0,0 +1,265 @@
+#include <ec/array.h>
+
+#include "ke.h"
+#include "../hw/cpu/isr.h"
+#include "../hw/timer/timer.h"
+
+//
+// Scheduling classes, tried in order. The fixed class keeps a FIFO per priority and
+// a bitmap of the non-empty ones, so picking is a bit scan. The fair class keeps
+// threads in an AVL tree by vruntime, the time they ran divided by their weight,
+// and always runs the one that is furthest behind, the cached leftmost one.
+// A thread that becomes ready preempts the running thread right away if it is in an
+// earlier class or its class says so, otherwise the switch waits for the time slice.
+// Every core has its own queues under its lock. Threads are queued on their own core,
+// another core that queues one there sends an interrupt if it should run now.
+//
+namespace ke
+{
+    struct SchedulingClass
+    {
+        void (*enqueue)(Core* core, Thread* thread, bool wakeup);
+        Thread* (*pick)(Core* core);
+        void (*charge)(Core* core, Thread* thread, u64 ns);
+        // Both threads are in this class.
+        bool (*preempts)(Core* core, Thread* woken, Thread* running);
+    };
+
+    static constexpr u64 ns_per_tick = 1'000'000'000 / timer::hpet::hz;
+
+    // Fair class tuning, in weighted nanoseconds.
+    static constexpr u64 sleeper_credit = 3 * ns_per_tick;
+    static constexpr u64 wakeup_granularity = ns_per_tick;
+
+    // Every priority step is worth about 25% more CPU time, the default priority weighs 1024.
+    static constexpr auto fair_weights = []()
+    {
+        ec::array<u64, priority_count> weights{};
+
+        weights[default_priority] = 1024;
+        for (u32 i = default_priority + 1; i < priority_count; i++)
+            weights[i] = weights[i - 1] * 5 / 4;
+        for (u32 i = default_priority; i > 0; i--)
+            weights[i - 1] = weights[i] * 4 / 5;
+
+        return weights;
+    }();
+
+    static void FixedEnqueue(Core* core, Thread* thread, bool)
+    {
+        auto& queues = core->run_queues;
+        const u32 priority = thread->sched.priority;
+
+        queues.fixed[priority].push_back(&thread->run_entry);
+        queues.fixed_ready |= 1u << priority;
+    }
+
+    static Thread* FixedPick(Core* core)
+    {
+        auto& queues = core->run_queues;
+        if (!queues.fixed_ready)
+            return nullptr;
+
+        const u32 priority = 31 - __builtin_clz(queues.fixed_ready);
+        auto thread = RunQueueThread(queues.fixed[priority].pop_front());
+        if (queues.fixed[priority].empty())
+            queues.fixed_ready &= ~(1u << priority);
+
+        return thread;
+    }
+
+    static void FixedCharge(Core*, Thread*, u64)
+    {
+    }
+
+    static bool FixedPreempts(Core*, Thread* woken, Thread* running)
+    {
+        return woken->sched.priority > running->sched.priority;
+    }
+
+    // Equal vruntimes go right, so they run in the order they were queued.
+    struct FairPolicy
+    {
+        INLINE static ec::avl_entry<Thread>& entry(Thread* thread)
+        {
+            return thread->fair_entry;
+        }
+
+        INLINE static bool less(const Thread* a, const Thread* b)
+        {
+            return a->vruntime < b->vruntime;
+        }
+
+        INLINE static void update(Thread*)
+        {
+        }
+    };
+
+    using FairTree = ec::avl<Thread, FairPolicy>;
+
+    static void UpdateMinVruntime(Core* core, Thread* running)
+    {
+        auto& queues = core->run_queues;
+        u64 vruntime = running ? running->vruntime : ~0ull;
+
+        if (auto first = queues.fair_first)
+            vruntime = ec::min(vruntime, first->vruntime);
+        if (vruntime != ~0ull)
+            queues.min_vruntime = ec::max(queues.min_vruntime, vruntime);
+    }
+
+    static void FairEnqueue(Core* core, Thread* thread, bool wakeup)
+    {
+        auto& queues = core->run_queues;
+
+        // New threads and sleepers start a little behind the others, so they run soon
+        // without having saved up time to monopolize the CPU with.
+        if (wakeup && queues.min_vruntime > sleeper_credit)
+            thread->vruntime = ec::max(thread->vruntime, queues.min_vruntime - sleeper_credit);
+
+        queues.fair = FairTree::insert(queues.fair, thread);
+        if (!queues.fair_first || thread->vruntime < queues.fair_first->vruntime)
+            queues.fair_first = thread;
+    }
+
+    static Thread* FairPick(Core* core)
+    {
+        auto& queues = core->run_queues;
+
+        auto thread = queues.fair_first;
+        if (!thread)
+            return nullptr;
+
+        queues.fair = FairTree::detach_min(queues.fair, thread);
+        queues.fair_first = FairTree::leftmost(queues.fair);
+        UpdateMinVruntime(core, thread);
+
+        return thread;
+    }
+
+    static void FairCharge(Core* core, Thread* thread, u64 ns)
+    {
+        thread->vruntime += ns * fair_weights[default_priority] / fair_weights[thread->sched.priority];
+        UpdateMinVruntime(core, thread);
+    }
+
+    static bool FairPreempts(Core*, Thread* woken, Thread* running)
+    {
+        return woken->vruntime + wakeup_granularity < running->vruntime;
+    }
+
+    static constexpr SchedulingClass scheduling_classes[]{
+        { FixedEnqueue, FixedPick, FixedCharge, FixedPreempts },
+        { FairEnqueue, FairPick, FairCharge, FairPreempts },
+    };
+
+    INLINE const SchedulingClass& ClassOf(const Thread* thread)
+    {
+        return scheduling_classes[( u32 )thread->sched.policy];
+    }
+
+    // Charges the running thread for the time since it was last charged, with the core's lock held.
+    static void UpdateCurrent(Core* core)
+    {
+        auto thread = core->current_thread;
+        const u64 now = Now();
+
+        if (thread != core->idle_thread)
+            ClassOf(thread).charge(core, thread, now - thread->exec_start);
+
+        thread->exec_start = now;
+    }
+
+    void ReadyThread(Thread* thread)
+    {
+        const bool prev = x64::DisableInterrupts();
+
+        auto core = thread->core;
+        const bool local = core == GetCore();
+        core->lock.Acquire();
+
+        auto running = core->current_thread;
+        const bool was_pending = core->need_resched;
+
+        thread->state = Thread::State::Ready;
+        ClassOf(thread).enqueue(core, thread, true);
+
+        if (running == core->idle_thread)
+        {
+            core->need_resched = true;
+        }
+        else if (running)
+        {
+            // The running thread of another core is charged by that core,
+            // comparing against its last charge is close enough.
+            if (local)
+                UpdateCurrent(core);
+
+            // Classes are ordered by the policy values.
+            if (thread->sched.policy != running->sched.policy)
+                core->need_resched |= thread->sched.policy < running->sched.policy;
+            else
+                core->need_resched |= ClassOf(thread).preempts(core, thread, running);
+        }
+
+        const bool notify = !local && core->need_resched && !was_pending;
+        core->lock.Release();
+
+        if (notify)
+            apic::SendIpi(core->apic_id, apic::Delivery::Fixed, apic::resched_int_vec);
+
+        if (prev)
+            x64::EnableInterrupts();
+    }
+
+    Thread* PickReadyThread(Core* core, Thread* prev)
+    {
+        core->lock.Acquire();
+
+        UpdateCurrent(core);
+        core->need_resched = false;
+
+        if (prev->state == Thread::State::Running && prev != core->idle_thread)
+        {
+            prev->state = Thread::State::Ready;
+            ClassOf(prev).enqueue(core, prev, false);
+        }
+
+        // Other cores look at the current thread to decide whether to interrupt this one,
+        // it changes under the lock.
+        auto next = core->idle_thread;
+        for (const auto& sched_class : scheduling_classes)
+        {
+            if (auto thread = sched_class.pick(core))
+            {
+                thread->slice_left = thread->sched.time_slice;
+                next = thread;
+                break;
+            }
+        }
+
+        next->exec_start = prev->exec_start;
+        core->current_thread = next;
+
+        core->lock.Release();
+        return next;
+    }
+
+    void SchedulerTick()
+    {
+        if (!core_initialized)
+            return;
+
+        auto core = GetCore();
+        auto thread = core->current_thread;
+        if (!thread || thread == core->idle_thread)
+            return;
+
+        core->lock.Acquire();
+        UpdateCurrent(core);
+        core->lock.Release();
+
+        if (thread->slice_left && !--thread->slice_left)
+            core->need_resched = true;
+    }
+}
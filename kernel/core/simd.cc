@@ -0,0 +1,161 @@
+#include <libc/mem.h>
+#include <ec/array.h>
+
+#include "ke.h"
+#include "simd.h"
+#include "../hw/cpu/cpuid.h"
+#include "../hw/gfx/output.h"
+
+//
+// Runtime dispatch to the vector kernels in simd_*.cc.
+// Every vector path runs inside a kernel FPU section and falls back to the
+// scalar routines when a section can't be entered.
+//
+
+namespace ke
+{
+    enum class SimdLevel : u8
+    {
+        None,
+        Sse2,
+        Avx2,
+    };
+
+    // Below this, saving the owner's vector state costs more than it saves.
+    static constexpr size_t simd_copy_threshold = KiB(2);
+
+#pragma data_seg(".data")
+    static SimdLevel simd_level = SimdLevel::None;
+    static bool crc32_supported = false; // SSE4.2
+#pragma data_seg()
+
+    //
+    // CRC32C (Castagnoli), reflected polynomial.
+    //
+    static constexpr u32 crc32c_poly = 0x82f63b78;
+
+    static constexpr auto crc32c_table = []()
+    {
+        ec::array<u32, 256> table{};
+        for (u32 i = 0; i < 256; i++)
+        {
+            u32 crc = i;
+            for (int bit = 0; bit < 8; bit++)
+                crc = (crc >> 1) ^ (crc & 1 ? crc32c_poly : 0);
+            table[i] = crc;
+        }
+        return table;
+    }();
+
+    EARLY void InitializeSimd()
+    {
+        using namespace x64;
+
+        Cpuid info(CpuidLeaf::Info);
+        Cpuid extended(CpuidLeaf::ExtendedFeatures);
+
+        // SSE2 is part of x64, AVX2 also needs the OS to have enabled the AVX state.
+        simd_level = SimdLevel::Sse2;
+        if (CheckCpuid(extended.ebx, CpuidFeature::AVX2) && (xstate_mask & xstate_avx))
+            simd_level = SimdLevel::Avx2;
+
+        crc32_supported = CheckCpuid(info.ecx, CpuidFeature::SSE4_2);
+
+        Print(
+            "SIMD: %s%s\n",
+            simd_level == SimdLevel::Avx2 ? "AVX2" : "SSE2",
+            crc32_supported ? ", CRC32" : ""
+        );
+    }
+
+    void CopyMemory(void* dst, const void* src, size_t n)
+    {
+        // With ERMS rep movsb is already as fast as vector loops for long copies.
+        if (n < simd_copy_threshold || x64::cpu_info.fast_strings || simd_level == SimdLevel::None)
+        {
+            memcpy(dst, src, n);
+            return;
+        }
+
+        KernelFpuGuard fpu;
+        if (!fpu)
+            memcpy(dst, src, n);
+        else if (simd_level == SimdLevel::Avx2)
+            CopyAvx2(dst, src, n);
+        else
+            CopySse2(dst, src, n);
+    }
+
+    void ZeroPages(void* dst, size_t pages)
+    {
+        if (simd_level == SimdLevel::None)
+        {
+            memzero(dst, pages * page_size);
+            return;
+        }
+
+        KernelFpuGuard fpu;
+        if (!fpu)
+            memzero(dst, pages * page_size);
+        else if (simd_level == SimdLevel::Avx2)
+            ZeroPagesAvx2(dst, pages);
+        else
+            ZeroPagesSse2(dst, pages);
+    }
+
+    void StreamLines(void* dst, size_t dst_pitch, const void* src, size_t src_pitch, size_t line_size, size_t lines)
+    {
+        auto d = ( u8* )dst;
+        auto s = ( const u8* )src;
+
+        // One section for the whole rectangle, entering it per line would save the owner's state each time.
+        KernelFpuGuard fpu;
+        if (!fpu || simd_level == SimdLevel::None || line_size < 4 * 32)
+        {
+            for (; lines; lines--, d += dst_pitch, s += src_pitch)
+                memcpy(d, s, line_size);
+            return;
+        }
+
+        for (; lines; lines--, d += dst_pitch, s += src_pitch)
+        {
+            if (simd_level == SimdLevel::Avx2)
+                StreamAvx2(d, s, line_size);
+            else
+                StreamSse2(d, s, line_size);
+        }
+
+        asm volatile("sfence" ::: "memory");
+    }
+
+    typedef u64 __attribute__((aligned(1), may_alias)) unaligned_u64;
+
+    // The crc32 instruction only uses general purpose registers, no FPU section is needed.
+    INLINE u32 Crc32cHardware(u32 crc, const u8* p, size_t n)
+    {
+        u64 crc64 = crc;
+
+        for (; n >= sizeof(u64); n -= sizeof(u64), p += sizeof(u64))
+            asm("crc32q %1, %0" : "+r"(crc64) : "rm"(*( const unaligned_u64* )p));
+
+        crc = ( u32 )crc64;
+        for (; n; n--, p++)
+            asm("crc32b %1, %0" : "+r"(crc) : "rm"(*p));
+
+        return crc;
+    }
+
+    u32 Crc32c(u32 crc, const void* data, size_t n)
+    {
+        auto p = ( const u8* )data;
+        crc = ~crc;
+
+        if (crc32_supported)
+            return ~Crc32cHardware(crc, p, n);
+
+        while (n--)
+            crc = (crc >> 8) ^ crc32c_table[(crc ^ *p++) & 0xff];
+
+        return ~crc;
+    }
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <base.h>
+
+#include "../common/va.h"
+
+//
+// Vector kernels behind CopyMemory, ZeroPages and StreamLines.
+// Each set is in its own file built with that instruction set enabled,
+// they must only be called inside a kernel FPU section.
+//
+
+namespace ke
+{
+    void CopySse2(void* dst, const void* src, size_t n);
+    void ZeroPagesSse2(void* dst, size_t pages);
+    void StreamSse2(void* dst, const void* src, size_t n);
+
+    void CopyAvx2(void* dst, const void* src, size_t n);
+    void ZeroPagesAvx2(void* dst, size_t pages);
+    void StreamAvx2(void* dst, const void* src, size_t n);
+}
@@ -0,0 +1,91 @@
+#include <libc/mem.h>
+
+#include "simd.h"
+
+// Built with -mavx2, see the makefile.
+
+namespace ke
+{
+    typedef long long v256 __attribute__((vector_size(32)));
+    typedef long long v256u __attribute__((vector_size(32), aligned(1)));
+
+    static constexpr size_t v256_size = sizeof(v256);
+
+    // n must be at least 32.
+    void CopyAvx2(void* dst, const void* src, size_t n)
+    {
+        auto d = ( u8* )dst;
+        auto s = ( const u8* )src;
+
+        // Align the stores, the loads stay unaligned.
+        const size_t head = -( uptr_t )d & (v256_size - 1);
+        memcpy(d, s, head);
+        d += head;
+        s += head;
+        n -= head;
+
+        for (; n >= 4 * v256_size; n -= 4 * v256_size, d += 4 * v256_size, s += 4 * v256_size)
+        {
+            const v256 a = (( const v256u* )s)[0];
+            const v256 b = (( const v256u* )s)[1];
+            const v256 c = (( const v256u* )s)[2];
+            const v256 e = (( const v256u* )s)[3];
+            (( v256* )d)[0] = a;
+            (( v256* )d)[1] = b;
+            (( v256* )d)[2] = c;
+            (( v256* )d)[3] = e;
+        }
+
+        memcpy(d, s, n);
+    }
+
+    // Non-temporal stores, zeroed pages are rarely read right away.
+    void ZeroPagesAvx2(void* dst, size_t pages)
+    {
+        const v256 zero = {};
+        const auto end = ( u8* )dst + pages * page_size;
+
+        for (auto p = ( u8* )dst; p < end; p += 4 * v256_size)
+        {
+            asm volatile(
+                "vmovntdq %1, 0(%0)\n"
+                "vmovntdq %1, 32(%0)\n"
+                "vmovntdq %1, 64(%0)\n"
+                "vmovntdq %1, 96(%0)"
+                :: "r"(p), "x"(zero) : "memory"
+            );
+        }
+
+        asm volatile("sfence" ::: "memory");
+    }
+
+    // Like CopyAvx2 with non-temporal stores, the caller issues the sfence.
+    void StreamAvx2(void* dst, const void* src, size_t n)
+    {
+        auto d = ( u8* )dst;
+        auto s = ( const u8* )src;
+
+        const size_t head = -( uptr_t )d & (v256_size - 1);
+        memcpy(d, s, head);
+        d += head;
+        s += head;
+        n -= head;
+
+        for (; n >= 4 * v256_size; n -= 4 * v256_size, d += 4 * v256_size, s += 4 * v256_size)
+        {
+            const v256 a = (( const v256u* )s)[0];
+            const v256 b = (( const v256u* )s)[1];
+            const v256 c = (( const v256u* )s)[2];
+            const v256 e = (( const v256u* )s)[3];
+            asm volatile(
+                "vmovntdq %1, 0(%0)\n"
+                "vmovntdq %2, 32(%0)\n"
+                "vmovntdq %3, 64(%0)\n"
+                "vmovntdq %4, 96(%0)"
+                :: "r"(d), "x"(a), "x"(b), "x"(c), "x"(e) : "memory"
+            );
+        }
+
+        memcpy(d, s, n);
+    }
+}
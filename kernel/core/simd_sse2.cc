@@ -0,0 +1,91 @@
+#include <libc/mem.h>
+
+#include "simd.h"
+
+// Built with -msse2, see the makefile.
+
+namespace ke
+{
+    typedef long long v128 __attribute__((vector_size(16)));
+    typedef long long v128u __attribute__((vector_size(16), aligned(1)));
+
+    static constexpr size_t v128_size = sizeof(v128);
+
+    // n must be at least 16.
+    void CopySse2(void* dst, const void* src, size_t n)
+    {
+        auto d = ( u8* )dst;
+        auto s = ( const u8* )src;
+
+        // Align the stores, the loads stay unaligned.
+        const size_t head = -( uptr_t )d & (v128_size - 1);
+        memcpy(d, s, head);
+        d += head;
+        s += head;
+        n -= head;
+
+        for (; n >= 4 * v128_size; n -= 4 * v128_size, d += 4 * v128_size, s += 4 * v128_size)
+        {
+            const v128 a = (( const v128u* )s)[0];
+            const v128 b = (( const v128u* )s)[1];
+            const v128 c = (( const v128u* )s)[2];
+            const v128 e = (( const v128u* )s)[3];
+            (( v128* )d)[0] = a;
+            (( v128* )d)[1] = b;
+            (( v128* )d)[2] = c;
+            (( v128* )d)[3] = e;
+        }
+
+        memcpy(d, s, n);
+    }
+
+    // Non-temporal stores, zeroed pages are rarely read right away.
+    void ZeroPagesSse2(void* dst, size_t pages)
+    {
+        const v128 zero = {};
+        const auto end = ( u8* )dst + pages * page_size;
+
+        for (auto p = ( u8* )dst; p < end; p += 4 * v128_size)
+        {
+            asm volatile(
+                "movntdq %1, 0(%0)\n"
+                "movntdq %1, 16(%0)\n"
+                "movntdq %1, 32(%0)\n"
+                "movntdq %1, 48(%0)"
+                :: "r"(p), "x"(zero) : "memory"
+            );
+        }
+
+        asm volatile("sfence" ::: "memory");
+    }
+
+    // Like CopySse2 with non-temporal stores, the caller issues the sfence.
+    void StreamSse2(void* dst, const void* src, size_t n)
+    {
+        auto d = ( u8* )dst;
+        auto s = ( const u8* )src;
+
+        const size_t head = -( uptr_t )d & (v128_size - 1);
+        memcpy(d, s, head);
+        d += head;
+        s += head;
+        n -= head;
+
+        for (; n >= 4 * v128_size; n -= 4 * v128_size, d += 4 * v128_size, s += 4 * v128_size)
+        {
+            const v128 a = (( const v128u* )s)[0];
+            const v128 b = (( const v128u* )s)[1];
+            const v128 c = (( const v128u* )s)[2];
+            const v128 e = (( const v128u* )s)[3];
+            asm volatile(
+                "movntdq %1, 0(%0)\n"
+                "movntdq %2, 16(%0)\n"
+                "movntdq %3, 32(%0)\n"
+                "movntdq %4, 48(%0)"
+                :: "r"(d), "x"(a), "x"(b), "x"(c), "x"(e) : "memory"
+            );
+        }
+
+        memcpy(d, s, n);
+    }
+}
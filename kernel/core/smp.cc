@@ -0,0 +1,270 @@
+#include <libc/mem.h>
+#include <ec/new.h>
+
+#include "ke.h"
+#include "trace.h"
+#include "../hw/cpu/isr.h"
+#include "../hw/cpu/msr.h"
+#include "../hw/gfx/output.h"
+#include "../hw/timer/timer.h"
+
+// See trampoline.asm.
+EXTERN_C u8 ApTrampoline[];
+EXTERN_C u8 ApTrampolineStartup[];
+EXTERN_C u8 ApTrampolineEnd[];
+EXTERN_C void ApEntry();
+
+//
+// Application processor startup and kernel TLB shootdown.
+// The boot processor starts the others one at a time with INIT and startup IPIs.
+// Each one runs the trampoline into long mode, sets itself up like the boot processor
+// did and waits in its idle thread until the scheduler runs.
+//
+namespace ke
+{
+    // Layout shared with trampoline.asm.
+    struct ApStartup
+    {
+        u32 page_table;
+        u32 efer;
+        u64 kernel_cr3;
+        u64 entry;
+        u64 stack;
+        u64 core;
+    };
+
+    // Descriptor tables and interrupt stacks of an application processor.
+    struct CoreTables
+    {
+        x64::GdtEntry gdt[8];
+        x64::Tss tss;
+        u8 ist_stacks[x64::IstCount][x64::ist_size];
+    };
+    static_assert(sizeof(CoreTables::gdt) == sizeof(x64::gdt));
+
+    static constexpr u64 init_delay_ns = 10'000'000;
+    static constexpr u64 startup_delay_ns = 200'000;
+    static constexpr u64 online_timeout_ns = 100'000'000;
+
+    static void Stall(u64 ns)
+    {
+        const u64 end = Now() + ns;
+        while (Now() < end)
+            _mm_pause();
+    }
+
+    Core* CreateCore(mm::PageTable* page_table, const x64::GdtEntry* gdt, x64::Tss* tss)
+    {
+        auto core = new (pool_tag::core) Core();
+
+        core->self = core;
+        core->page_table = page_table;
+
+        core->gdt = gdt;
+        core->idt = x64::idt.data();
+        core->tss = tss;
+        core->timer_wheel.time = timer::ticks;
+        core->thread_list.init();
+        core->run_queues.init();
+        core->exited_threads.init();
+
+        return core;
+    }
+
+    static Core* CreateApplicationCore(u8 apic_id)
+    {
+        auto tables = Allocate<CoreTables>(sizeof(CoreTables), pool_tag::core);
+        tables->tss = x64::Tss(
+            ( u64 )(tables->ist_stacks[0] + x64::ist_size),
+            ( u64 )(tables->ist_stacks[1] + x64::ist_size),
+            ( u64 )(tables->ist_stacks[2] + x64::ist_size),
+            ( u64 )(tables->ist_stacks[3] + x64::ist_size)
+        );
+
+        // The GDT is filled in by the core itself, see x64::InitializeProcessor.
+        auto core = CreateCore(GetCore()->page_table, tables->gdt, &tables->tss);
+        core->index = core_count;
+        core->apic_id = apic_id;
+
+        auto kstack = ( vaddr_t )Allocate(page_size, pool_tag::stack) + page_size;
+        CreateIdleThread(core, kstack);
+        AllocateTraceBuffer(core);
+
+        return core;
+    }
+
+    static bool StartProcessor(Core* core, paddr_t trampoline)
+    {
+        apic::SendIpi(core->apic_id, apic::Delivery::Init);
+        Stall(init_delay_ns);
+
+        // A second startup IPI is only needed if the first one got lost.
+        for (u32 attempt = 0; attempt < 2 && !__atomic_load_n(&core->online, __ATOMIC_ACQUIRE); attempt++)
+        {
+            apic::SendIpi(core->apic_id, apic::Delivery::Startup, ( u8 )(trampoline / page_size));
+            Stall(startup_delay_ns);
+        }
+
+        const u64 deadline = Now() + online_timeout_ns;
+        while (!__atomic_load_n(&core->online, __ATOMIC_ACQUIRE) && Now() < deadline)
+            _mm_pause();
+
+        return __atomic_load_n(&core->online, __ATOMIC_ACQUIRE);
+    }
+
+    // Page 0 is the code, pages 1 to 3 a PML4, PDPT and PD identity mapping the first 2 MiB.
+    static ApStartup* PrepareTrampoline(paddr_t trampoline, vaddr_t trampoline_va)
+    {
+        auto& table = *GetCore()->page_table;
+
+        memzero(( void* )trampoline_va, trampoline_pages * page_size);
+        memcpy(( void* )trampoline_va, ApTrampoline, ApTrampolineEnd - ApTrampoline);
+
+        auto pml4 = ( u64* )(trampoline_va + page_size);
+        auto pdpt = ( u64* )(trampoline_va + 2 * page_size);
+        auto pd = ( u64* )(trampoline_va + 3 * page_size);
+
+        // The kernel half is shared, so the jump to ApEntry lands in the kernel image.
+        auto kernel_pml4 = ( const u64* )mm::GetPoolEntryVa(table, table.root);
+        for (size_t i = 256; i < 512; i++)
+            pml4[i] = kernel_pml4[i];
+
+        pml4[0] = (trampoline + 2 * page_size) | x64::page_present | x64::page_writable;
+        pdpt[0] = (trampoline + 3 * page_size) | x64::page_present | x64::page_writable;
+        pd[0] = x64::page_present | x64::page_writable | x64::page_large;
+
+        auto startup = ( ApStartup* )(trampoline_va + (ApTrampolineStartup - ApTrampoline));
+        startup->page_table = ( u32 )(trampoline + page_size);
+        startup->efer = ( u32 )(ReadMsr(x64::Msr::EFER) & ~EFER_LMA);
+        startup->kernel_cr3 = table.root;
+        startup->entry = ( u64 )ApEntry;
+
+        return startup;
+    }
+
+    void StartProcessors(paddr_t trampoline, vaddr_t trampoline_va)
+    {
+        const u32 count = ec::min<u32>(x64::cpu_info.cores, x64::max_cores);
+        if (count < 2 || !apic::local)
+            return;
+
+        if (!trampoline)
+        {
+            Print("No memory below 1 MiB to start the other cores.\n");
+            return;
+        }
+
+        // IPIs go through the local APICs, the boot processor's has to be enabled for them
+        // even while the PIC delivers its interrupts.
+        auto boot = GetCore();
+        apic::UnmaskInterrupts();
+        boot->apic_id = apic::GetId();
+
+        auto startup = PrepareTrampoline(trampoline, trampoline_va);
+
+        for (u32 i = 0; i < count; i++)
+        {
+            const u8 apic_id = x64::cpu_info.apic_ids[i];
+            if (apic_id == boot->apic_id)
+                continue;
+
+            auto core = CreateApplicationCore(apic_id);
+            startup->stack = core->idle_thread->context.rsp;
+            startup->core = ( u64 )core;
+
+            // A late core would run outside cores, with the next core's startup block.
+            // INIT puts it back into wait-for-SIPI, its memory just stays allocated.
+            if (!StartProcessor(core, trampoline))
+            {
+                apic::SendIpi(apic_id, apic::Delivery::Init);
+                Print("Core with APIC ID %u did not start.\n", apic_id);
+                continue;
+            }
+
+            cores[core_count] = core;
+            __atomic_store_n(&core_count, core_count + 1, __ATOMIC_RELEASE);
+        }
+
+        Print("%u of %u cores online\n", core_count, count);
+    }
+
+    void ShootdownKernelTlb()
+    {
+        const u32 count = __atomic_load_n(&core_count, __ATOMIC_ACQUIRE);
+        if (count < 2)
+            return;
+
+        auto self = GetCore();
+        u64 tickets[x64::max_cores];
+
+        // An NMI gets through even if the core spins on a lock with interrupts disabled.
+        // Only one is sent per core at a time, a second one could be merged with it.
+        for (u32 i = 0; i < count; i++)
+        {
+            auto core = cores[i];
+            if (core == self)
+                continue;
+
+            tickets[i] = __atomic_add_fetch(&core->tlb_requests, 1, __ATOMIC_SEQ_CST);
+            if (!__atomic_exchange_n(&core->tlb_nmi_sent, true, __ATOMIC_SEQ_CST))
+                apic::SendIpi(core->apic_id, apic::Delivery::Nmi);
+        }
+
+        for (u32 i = 0; i < count; i++)
+        {
+            if (cores[i] == self)
+                continue;
+
+            while (__atomic_load_n(&cores[i]->tlb_done, __ATOMIC_ACQUIRE) < tickets[i])
+                _mm_pause();
+        }
+    }
+
+    bool HandleTlbShootdown()
+    {
+        const u32 count = __atomic_load_n(&core_count, __ATOMIC_ACQUIRE);
+        if (count < 2)
+            return false;
+
+        // GS can still hold the user value if the NMI hit a kernel entry, the APIC ID can't lie.
+        const u8 apic_id = apic::GetId();
+
+        Core* core = nullptr;
+        for (u32 i = 0; i < count && !core; i++)
+        {
+            if (cores[i]->apic_id == apic_id)
+                core = cores[i];
+        }
+
+        if (!core || !__atomic_exchange_n(&core->tlb_nmi_sent, false, __ATOMIC_SEQ_CST))
+            return false;
+
+        // Requests made after this read send another NMI.
+        const u64 requests = __atomic_load_n(&core->tlb_requests, __ATOMIC_SEQ_CST);
+        x64::TlbFlushAll();
+        __atomic_store_n(&core->tlb_done, requests, __ATOMIC_RELEASE);
+
+        return true;
+    }
+}
+
+EXTERN_C NO_RETURN void ApInitialize(ke::Core* core)
+{
+    // The GDT is this core's own copy, CreateApplicationCore allocated it writable.
+    x64::InitializeProcessor(const_cast<x64::GdtEntry*>(core->gdt), core->tss);
+    x64::LoadCr3(core->page_table->root, core->page_table->pcid, true);
+
+    WriteMsr(x64::Msr::KERNEL_GS_BASE, ( uptr_t )core);
+    _writegsbase_u64(( uptr_t )core);
+
+    apic::InitializeLocal();
+
+    __atomic_store_n(&core->online, true, __ATOMIC_RELEASE);
+
+    // The first idle loop turns on preemption everywhere, the boot processor has to finish first.
+    while (!__atomic_load_n(&ke::schedule, __ATOMIC_ACQUIRE))
+        _mm_pause();
+
+    x64::LoadContext(&core->idle_thread->context, 0);
+    ke::Panic(Status::Unreachable);
+}
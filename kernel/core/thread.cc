@@ -3,6 +3,7 @@
 #include <ec/new.h>
 
 #include "ke.h"
+#include "trace.h"
 #include "../hw/gfx/output.h"
 #include "../hw/timer/timer.h"
 
@@ -20,6 +21,11 @@ EXTERN_C uptr_t kernel_stack_top;
 namespace ke
 {
     ec::const_bitmap<u64, 8> thread_map{}; // max 511 threads (idle = 0)
+    static size_t thread_id_hint;
+
+#pragma data_seg(".data")
+    static SpinLock thread_id_lock{};
+#pragma data_seg()
 
     NO_RETURN int IdleLoop(u64)
     {
@@ -31,27 +37,43 @@ namespace ke
 
     void RegisterThread(Thread* thread)
     {
-        GetCore()->thread_list_head.push(&(thread->thread_list_entry));
+        SpinLockGuard guard(thread->core->lock);
+
+        thread->core->thread_list.push_back(&thread->thread_list_entry);
+        __atomic_add_fetch(&thread->core->thread_count, 1, __ATOMIC_RELAXED);
     }
 
     void UnregisterThread(Thread* thread)
     {
-        GetCore()->thread_list_head.remove(&(thread->thread_list_entry));
+        SpinLockGuard guard(thread->core->lock);
+
+        thread->thread_list_entry.remove();
+        __atomic_sub_fetch(&thread->core->thread_count, 1, __ATOMIC_RELAXED);
     }
 
     void FreeThread(Thread* thread)
     {
         DbgPrint("Freeing thread %u\n", thread->id);
 
-        if (!thread_map.has_bit(thread->id))
-            Panic(Status::DoubleFree, thread->id);
+        {
+            SpinLockGuard guard(thread_id_lock);
 
-        thread_map.clear_bit(thread->id);
+            if (!thread_map.has_bit(thread->id))
+                Panic(Status::DoubleFree, thread->id);
+
+            thread_map.clear_bit(thread->id);
+        }
 
         Free(( void* )thread->kernel_stack_top);
         if (thread->user_stack_top)
             Free(( void* )thread->user_stack_top);
 
+        // The registers can keep the old state, the next owner overwrites them without saving.
+        auto core = GetCore();
+        if (core->fpu_owner == thread)
+            core->fpu_owner = nullptr;
+        x64::FreeFpuState(thread->fpu_state);
+
         delete thread;
     }
 
@@ -69,7 +91,10 @@ namespace ke
         SelectNextThread();
 
         UnregisterThread(thread);
-        FreeThread(thread);
+
+        // This stack is in use until LoadContext, another core could reuse it right away.
+        // The next thread switch on this core frees the thread.
+        GetCore()->exited_threads.push_back(&thread->thread_list_entry);
 
         // Update to the next thread.
         thread = GetCurrentThread();
@@ -109,34 +134,30 @@ namespace ke
 
     void AllocateThreadId(Thread* thread)
     {
-        for (u64 i = 0; i < thread_map.size(); i++)
-        {
-            if (thread_map[i] == ec::umax_v<u64>)
-                continue;
-
-            for (u64 j = 0; j < thread_map.bits_per_member; j++)
-            {
-                u64 id = i * thread_map.bits_per_member + j;
-
-                if (!thread_map.has_bit(id))
-                {
-                    thread_map.set_bit(id);
-                    thread->id = id;
-                    return;
-                }
-            }
-        }
+        SpinLockGuard guard(thread_id_lock);
+
+        // Next fit, so recently freed IDs aren't handed out again right away.
+        auto id = thread_map.find_first_clear(thread_id_hint);
+        if (id == thread_map.npos)
+            id = thread_map.find_first_clear(0, thread_id_hint);
+
+        if (id == thread_map.npos)
+            Panic(Status::OutOfIds);
 
-        Panic(Status::OutOfIds);
+        thread_map.set_bit(id);
+        thread_id_hint = id + 1;
+        thread->id = id;
     }
 
-    Thread* CreateThreadInternal(ThreadStartFunction function, u64 arg, vaddr_t kstack)
+    Thread* CreateThreadInternal(ThreadStartFunction function, u64 arg, vaddr_t kstack, const SchedParams& params)
     {
-        auto thread = new Thread();
+        auto thread = new (pool_tag::thread) Thread();
 
         AllocateThreadId(thread);
         thread->function = function;
         thread->arg = arg;
+        thread->sched = params;
+        thread->sched.priority = ec::min<u8>(params.priority, priority_count - 1);
 
         thread->kernel_stack_top = kstack - page_size;
 
@@ -151,17 +172,25 @@ namespace ke
         return thread;
     }
 
+    Thread* CreateIdleThread(Core* core, vaddr_t kstack)
+    {
+        auto idle_thread = CreateThreadInternal(IdleLoop, 0, kstack);
+        idle_thread->core = core;
+
+        core->idle_thread = idle_thread;
+        core->current_thread = idle_thread;
+        return idle_thread;
+    }
+
     void StartScheduler()
     {
-        auto core = GetCore();
-        memzero(thread_map.data(), thread_map.size());
+        memzero(thread_map.data(), sizeof thread_map);
+        thread_id_hint = 0;
 
         // FIXME - can we use kernel_stack_top here?
         // since every thread is going to have its own kernel stack,
         // we should be able to use the boot stack for the idle loop
-        auto idle_thread = CreateThreadInternal(IdleLoop, 0, kernel_stack_top);
-        core->idle_thread = idle_thread;
-        core->current_thread = idle_thread;
+        CreateIdleThread(GetCore(), kernel_stack_top);
     }
 
     //
@@ -199,103 +228,183 @@ namespace ke
     }
 
     Thread* CreateThread(ThreadStartFunction function, u64 arg, vaddr_t kstack)
+    {
+        return CreateThread(function, arg, SchedParams{}, kstack);
+    }
+
+    // The online core with the fewest threads. Threads don't migrate later, so this is
+    // the only load balancing there is.
+    static Core* PlaceThread()
+    {
+        auto best = GetCore();
+        const u32 count = __atomic_load_n(&core_count, __ATOMIC_ACQUIRE);
+
+        for (u32 i = 0; i < count; i++)
+        {
+            if (__atomic_load_n(&cores[i]->thread_count, __ATOMIC_RELAXED) <
+                __atomic_load_n(&best->thread_count, __ATOMIC_RELAXED))
+                best = cores[i];
+        }
+
+        return best;
+    }
+
+    Thread* CreateThread(ThreadStartFunction function, u64 arg, const SchedParams& params, vaddr_t kstack)
     {
         if (!kstack)
         {
-            kstack = ( vaddr_t )Allocate(page_size);
+            kstack = ( vaddr_t )Allocate(page_size, pool_tag::stack);
             kstack += page_size; // Stack starts at the top...
         }
 
-        auto thread = CreateThreadInternal(function, arg, kstack);
+        auto thread = CreateThreadInternal(function, arg, kstack, params);
+        thread->core = PlaceThread();
         RegisterThread(thread);
+        ReadyThread(thread);
         DbgPrint("New thread with ID: %llu\n", thread->id);
 
         return thread;
     }
 
+    static void WakeThread(Timer* timer, u64 arg)
+    {
+        auto thread = ( Thread* )arg;
+
+        TRACE(Wakeup, ( u32 )thread->id, timer::ticks - timer->expires);
+        ReadyThread(thread);
+    }
+
+    static bool PickNextThread()
+    {
+        auto core = GetCore();
+        auto prev = core->current_thread;
+
+        auto next = PickReadyThread(core, prev);
+        if (next == prev)
+        {
+            // Nothing else to run, or nothing better.
+            if (prev != core->idle_thread)
+                prev->state = Thread::State::Running;
+
+            DbgPrint("SelectNextThread: keeping %llu\n", prev->id);
+            return false;
+        }
+
+        TRACE(ContextSwitch, ( u32 )prev->id, next->id);
+
+        if (prev == core->idle_thread)
+            prev->state = Thread::State::Ready;
+
+        next->state = Thread::State::Running;
+
+        // Architecture-specific changes
+        core->kernel_stack = core->tss->rsp0 = next->context.rsp;
+        core->user_stack = next->user_stack;
+
+        // Only trap on the next SIMD instruction if the registers hold another thread's state.
+        x64::SetTaskSwitched(next != core->fpu_owner);
+
+        DbgPrint("SelectNextThread: switching from %llu to %llu\n", prev->id, next->id);
+        return true;
+    }
+
+    // Threads only queue themselves here once they no longer pick a next thread,
+    // so none of them is still on its stack.
+    static void ReapExitedThreads(Core* core)
+    {
+        while (auto entry = core->exited_threads.pop_front())
+            FreeThread(CONTAINING_RECORD(entry, Thread, thread_list_entry));
+    }
+
     //
     // Returns true if a new thread was selected.
     // Always returns with interrupts disabled.
+    // The periodic tick only runs while a thread does, an idle core sleeps
+    // until the first of its timers expires.
     //
     bool SelectNextThread()
     {
         _disable();
 
         auto core = GetCore();
-        if (!core->GetFirstThread()) // No threads available, leave early.
+        ReapExitedThreads(core);
+
+        const bool switched = PickNextThread();
+
+        if (core->current_thread == core->idle_thread)
+            timer::StopTick(NextTimerExpiry());
+        else
+            timer::StartTick();
+
+        return switched;
+    }
+
+    //
+    // #NM handler, the current thread used the FPU while CR0.TS was set.
+    // Saves the state of the previous owner and loads the current thread's state.
+    //
+    void HandleFpuTrap()
+    {
+        auto core = GetCore();
+        auto thread = core->current_thread;
+
+        // Allocate before touching the registers, growing the heap can use a kernel FPU section.
+        if (!thread->fpu_state)
         {
-            DbgPrint("SelectNextThread: empty\n");
-            return false;
+            thread->fpu_state = x64::AllocateFpuState();
+            if (!thread->fpu_state)
+                Panic(Status::OutOfMemory, thread->id);
         }
 
-        ec::slist_entry* entry;
-        Thread* next;
-        auto prev = core->current_thread;
+        x64::SetTaskSwitched(false);
+        if (core->fpu_owner == thread)
+            return;
 
-        if (prev == core->idle_thread)
-        {
-            // Switching from idle loop.
-            // In this case, start searching from the first thread.
-            DbgPrint("SelectNextThread: attempting switch from idle\n");
-
-            for (entry = core->GetFirstThread(); ; entry = entry->m_next)
-            {
-                next = CONTAINING_RECORD(entry, Thread, thread_list_entry);
-
-                if (next->state == Thread::State::Ready)
-                    break;
-                if (next->state == Thread::State::Waiting && next->delay <= timer::ticks)
-                    break;
-
-                // If we're at the end and nothing was found, keep the idle thread.
-                if (entry->m_next == core->GetFirstThread())
-                {
-                    DbgPrint("SelectNextThread: staying idle\n");
-                    return false;
-                }
-            }
+        if (core->fpu_owner)
+            x64::SaveFpuState(core->fpu_owner->fpu_state);
 
-        }
-        else /* Switching from standard thread */
+        x64::RestoreFpuState(thread->fpu_state);
+        core->fpu_owner = thread;
+    }
+
+    bool KernelFpuBegin()
+    {
+        if (!core_initialized)
+            return false;
+
+        bool prev = x64::DisableInterrupts();
+
+        auto core = GetCore();
+        const bool acquired = !core->kernel_fpu_active;
+        if (acquired)
         {
-            DbgPrint("SelectNextThread: attempting switch from thread %llu\n", prev->id);
-
-            // Start searching from the next thread
-            for (entry = prev->thread_list_entry.m_next; ; entry = entry->m_next)
-            {
-                next = CONTAINING_RECORD(entry, Thread, thread_list_entry);
-
-                if (next->state == Thread::State::Ready)
-                    break;
-                if (next->state == Thread::State::Waiting && next->delay <= timer::ticks)
-                    break;
-
-                if (next == prev) // Back at where we began
-                {
-                    if (next->state == Thread::State::Running)
-                        return false; // No other suitable thread found, so just take this one again
-
-                    // If we're here, all threads are waiting.
-                    // Switch to the idle loop until there is something to do.
-                    next = core->idle_thread;
-                    break;
-                }
-            }
+            core->kernel_fpu_active = true;
+            core->preempt_count++;
+
+            // The registers now belong to the kernel, the old owner gets its state back through #NM.
+            x64::SetTaskSwitched(false);
+            if (core->fpu_owner)
+                x64::SaveFpuState(core->fpu_owner->fpu_state);
+            core->fpu_owner = nullptr;
         }
 
-        // Set the old thread back to ready, unless it is still waiting.
-        if (prev->state == Thread::State::Running)
-            prev->state = Thread::State::Ready;
+        if (prev)
+            x64::EnableInterrupts();
 
-        next->state = Thread::State::Running;
-        core->current_thread = next;
+        return acquired;
+    }
 
-        // Architecture-specific changes
-        core->kernel_stack = core->tss->rsp0 = next->context.rsp;
-        core->user_stack = next->user_stack;
+    void KernelFpuEnd()
+    {
+        bool prev = x64::DisableInterrupts();
 
-        DbgPrint("SelectNextThread: switching from %llu to %llu\n", prev->id, next->id);
-        return true;
+        auto core = GetCore();
+        x64::SetTaskSwitched(true);
+        core->kernel_fpu_active = false;
+        core->preempt_count--;
+
+        if (prev)
+            x64::EnableInterrupts();
     }
 
     void Yield()
@@ -318,12 +427,22 @@ namespace ke
 
     void Delay(u64 ticks)
     {
-        auto thread = GetCurrentThread();
+        if (!ticks)
+        {
+            Yield();
+            return;
+        }
 
+        // The timer can't fire before the thread is off the CPU.
+        const bool prev = x64::DisableInterrupts();
+
+        auto thread = GetCurrentThread();
         thread->state = Thread::State::Waiting;
-        if (ticks > 0)
-            thread->delay = timer::ticks + ticks;
+        SetTimer(&thread->wait_timer, timer::ticks + ticks, WakeThread, ( u64 )thread);
 
         Yield();
+
+        if (prev)
+            x64::EnableInterrupts();
     }
 }
@@ -0,0 +1,227 @@
+#include "ke.h"
+#include "../hw/timer/timer.h"
+
+//
+// Hierarchical timing wheel, as in classic Unix kernels.
+// Level 0 has a slot per tick for the next 64 ticks. A slot on level n holds every
+// timer of a 64^n tick block, and when the wheel enters that block its timers move
+// down a level. Arming and cancelling are O(1), every tick expires one level 0 slot.
+// Every core has its own wheel. A timer goes on the wheel of the core arming it and
+// remembers that wheel, so cancelling it from another core locks the right one.
+//
+namespace ke
+{
+    static constexpr u64 slot_mask = wheel_slots - 1;
+    static constexpr u64 wheel_span = 1ull << (wheel_slot_bits * wheel_levels);
+
+    INLINE u64 RotateRight(u64 value, u32 count)
+    {
+        return count ? (value >> count) | (value << (64 - count)) : value;
+    }
+
+    static void Link(TimerWheel& wheel, Timer* timer, u32 level, u32 index)
+    {
+        auto& head = wheel.slots[level][index];
+
+        timer->next = head;
+        if (head)
+            head->pprev = &timer->next;
+        head = timer;
+        timer->pprev = &head;
+        timer->slot = level * wheel_slots + index;
+        __atomic_store_n(&timer->wheel, &wheel, __ATOMIC_RELEASE);
+
+        wheel.occupied[level] |= 1ull << index;
+    }
+
+    static void Unlink(TimerWheel& wheel, Timer* timer)
+    {
+        *timer->pprev = timer->next;
+        if (timer->next)
+            timer->next->pprev = timer->pprev;
+        timer->pprev = nullptr;
+
+        const u32 level = timer->slot / wheel_slots;
+        const u32 index = timer->slot % wheel_slots;
+        if (!wheel.slots[level][index])
+            wheel.occupied[level] &= ~(1ull << index);
+    }
+
+    static void Insert(TimerWheel& wheel, Timer* timer)
+    {
+        // Late timers go into the slot expired next.
+        u64 at = ( i64 )(timer->expires - wheel.time) < 0 ? wheel.time : timer->expires;
+
+        // Past the last level they wait in its furthest slot and are sorted again from there.
+        if (at - wheel.time >= wheel_span)
+            at = wheel.time + wheel_span - 1;
+
+        u32 level = 0;
+        while (level < wheel_levels - 1 && at - wheel.time >= 1ull << (wheel_slot_bits * (level + 1)))
+            level++;
+
+        Link(wheel, timer, level, (at >> (wheel_slot_bits * level)) & slot_mask);
+    }
+
+    static Timer* Detach(TimerWheel& wheel, u32 level, u32 index)
+    {
+        auto list = wheel.slots[level][index];
+        wheel.slots[level][index] = nullptr;
+        wheel.occupied[level] &= ~(1ull << index);
+        return list;
+    }
+
+    // Moves the block the wheel just entered down a level, returns its slot index.
+    static u32 Cascade(TimerWheel& wheel, u32 level)
+    {
+        const u32 index = (wheel.time >> (wheel_slot_bits * level)) & slot_mask;
+
+        for (auto timer = Detach(wheel, level, index); timer;)
+        {
+            auto next = timer->next;
+            Insert(wheel, timer);
+            timer = next;
+        }
+
+        return index;
+    }
+
+    // Locks the wheel the timer was last armed on, null if it never was. Interrupts are disabled.
+    static TimerWheel* LockTimerWheel(Timer* timer)
+    {
+        for (;;)
+        {
+            auto wheel = __atomic_load_n(&timer->wheel, __ATOMIC_ACQUIRE);
+            if (!wheel)
+                return nullptr;
+
+            wheel->lock.Acquire();
+            if (timer->wheel == wheel)
+                return wheel;
+
+            // Another core re-armed it meanwhile.
+            wheel->lock.Release();
+        }
+    }
+
+    void SetTimer(Timer* timer, u64 expires, TimerCallback callback, u64 arg)
+    {
+        const bool prev = x64::DisableInterrupts();
+
+        // The timer moves to this core's wheel, only one wheel lock is held at a time.
+        CancelTimer(timer);
+
+        auto& wheel = GetCore()->timer_wheel;
+        wheel.lock.Acquire();
+
+        timer->expires = expires;
+        timer->callback = callback;
+        timer->arg = arg;
+        Insert(wheel, timer);
+
+        wheel.lock.Release();
+        if (prev)
+            x64::EnableInterrupts();
+    }
+
+    bool CancelTimer(Timer* timer)
+    {
+        const bool prev = x64::DisableInterrupts();
+
+        bool armed = false;
+        if (auto wheel = LockTimerWheel(timer))
+        {
+            armed = timer->pprev;
+            if (armed)
+                Unlink(*wheel, timer);
+
+            wheel->lock.Release();
+        }
+
+        if (prev)
+            x64::EnableInterrupts();
+
+        return armed;
+    }
+
+    void ExpireTimers()
+    {
+        if (!core_initialized)
+            return;
+
+        auto& wheel = GetCore()->timer_wheel;
+        const u64 now = timer::ticks;
+
+        wheel.lock.Acquire();
+        while (wheel.time <= now)
+        {
+            u64 occupied = 0;
+            for (auto bits : wheel.occupied)
+                occupied |= bits;
+
+            // An empty wheel has nothing to cascade either.
+            if (!occupied)
+            {
+                wheel.time = now + 1;
+                break;
+            }
+
+            const u32 index = wheel.time & slot_mask;
+            if (!index)
+            {
+                for (u32 level = 1; level < wheel_levels && !Cascade(wheel, level); level++)
+                    EMPTY_STMT;
+            }
+
+            // Timers leave the slot one at a time, a callback may cancel the others.
+            // Anything re-armed lands in a later slot, one due by now in a slot this loop still visits.
+            wheel.time++;
+
+            while (auto timer = wheel.slots[0][index])
+            {
+                Unlink(wheel, timer);
+
+                // Another core may re-arm the timer once it is unlinked, and the callback may arm timers here.
+                const auto callback = timer->callback;
+                const u64 arg = timer->arg;
+
+                wheel.lock.Release();
+                callback(timer, arg);
+                wheel.lock.Acquire();
+            }
+        }
+        wheel.lock.Release();
+    }
+
+    u64 NextTimerExpiry()
+    {
+        auto& wheel = GetCore()->timer_wheel;
+        SpinLockGuard guard(wheel.lock);
+        u64 next = ~0ull;
+
+        for (u32 level = 0; level < wheel_levels; level++)
+        {
+            if (!wheel.occupied[level])
+                continue;
+
+            // Slots are visited in time order starting with the next block to expire. Above
+            // level 0 the current block was already cascaded, unless the wheel stands at its start.
+            const u32 shift = wheel_slot_bits * level;
+            const bool cascaded = level && (wheel.time & ((1ull << shift) - 1));
+            const u32 start = ((wheel.time >> shift) + cascaded) & slot_mask;
+            const u32 offset = __builtin_ctzll(RotateRight(wheel.occupied[level], start));
+
+            if (!level)
+            {
+                // Level 0 slots are single ticks.
+                next = wheel.time + offset;
+                continue;
+            }
+
+            for (auto timer = wheel.slots[level][(start + offset) & slot_mask]; timer; timer = timer->next)
+                next = ec::min(next, timer->expires);
+        }
+
+        return next;
+    }
+}
@@ -0,0 +1,118 @@
+#include <libc/print.h>
+#include <libc/str.h>
+
+#include "trace.h"
+#include "../hw/gfx/output.h"
+#include "../hw/serial/serial.h"
+#include "../hw/timer/timer.h"
+
+namespace ke
+{
+#pragma data_seg(".data")
+    // TSC and timer ticks at InitializeTrace, the decoder derives the TSC rate from them
+    // when it wasn't calibrated.
+    static u64 trace_start_tsc = 0;
+    static u64 trace_start_ticks = 0;
+    static bool trace_dump_pending = false;
+#pragma data_seg()
+
+    void AllocateTraceBuffer(Core* core)
+    {
+#if KERNEL_TRACE
+        core->trace_buffer = Allocate<TraceRecord>(trace_records * sizeof(TraceRecord), pool_tag::trace);
+        core->trace_head = 0;
+#endif
+    }
+
+    void InitializeTrace()
+    {
+#if KERNEL_TRACE
+        AllocateTraceBuffer(GetCore());
+
+        trace_start_tsc = __rdtsc();
+        trace_start_ticks = timer::ticks;
+        trace_enabled = true;
+#endif
+    }
+
+    // Goes through the transmit ring, waiting for room since a dump is far larger than it.
+    static void TraceLine(const char* fmt, ...)
+    {
+        char line[128]{};
+        va_list ap;
+        va_start(ap, fmt);
+        vsnprintf(line, sizeof line, fmt, ap);
+        va_end(ap);
+
+        const size_t length = strlen(line);
+        for (size_t sent = 0; sent < length;)
+        {
+            sent += serial::Send(line + sent, length - sent);
+            if (sent < length)
+                Delay(1);
+        }
+    }
+
+    static void DumpCoreTrace(Core* core)
+    {
+        if (!core->trace_buffer)
+            return;
+
+        const u32 head = core->trace_head;
+        const u32 count = head < trace_records ? head : trace_records;
+
+        // The log may have stopped in the middle of a line.
+        TraceLine(
+            "\n#TRACE BEGIN core %u records %u tsc %llx ticks %llu now_tsc %llx now_ticks %llu hz %u tsc_hz %llu\n",
+            core->index,
+            count,
+            trace_start_tsc,
+            trace_start_ticks,
+            __rdtsc(),
+            timer::ticks,
+            timer::hpet::hz, // The PIT runs at the same rate
+            GetTscFrequency()
+        );
+
+        for (u32 i = head - count; i != head; i++)
+        {
+            const auto& r = core->trace_buffer[i & (trace_records - 1)];
+            TraceLine("#T %llx %u %u %x %llx %llx\n", r.tsc, ( u32 )r.type, r.thread, r.a, r.b, r.c);
+        }
+
+        TraceLine("#TRACE END\n");
+    }
+
+    void DumpTrace()
+    {
+        if (!core_initialized || !serial::GetPort())
+            return;
+
+        // Stop recording so the rings don't move while they are written out. A record
+        // another core already started may still land, the TSC sorts it in.
+        // Log messages wait meanwhile, they would land between the lines.
+        const bool was_enabled = ec::exchange(trace_enabled, false);
+        gfx::PauseLog(true);
+
+        for (u32 i = 0; i < core_count; i++)
+            DumpCoreTrace(cores[i]);
+
+        gfx::PauseLog(false);
+        trace_enabled = was_enabled;
+    }
+
+    static int TraceDumpThread(u64)
+    {
+        DumpTrace();
+        trace_dump_pending = false;
+        return 0;
+    }
+
+    void RequestTraceDump()
+    {
+        if (ec::exchange(trace_dump_pending, true))
+            return;
+
+        CreateThread(TraceDumpThread, 0);
+    }
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include "ke.h"
+
+//
+// Set to 0 to compile every TRACE() out, arguments included.
+//
+#define KERNEL_TRACE 1
+
+//
+// Binary event trace, like ftrace.
+// Every core owns a ring of fixed-size records stamped with the TSC. Recording is
+// one atomic add and a few stores, safe from interrupt handlers, and old records are
+// overwritten. DumpTrace writes the ring over serial, tools/trace2json.py turns it
+// into a Chrome trace.
+//
+namespace ke
+{
+    enum class TraceType : u16
+    {
+        ContextSwitch,  // a = previous thread, b = next thread
+        IrqEnter,       // a = IRQ
+        IrqExit,        // a = IRQ
+        Syscall,        // a = number, b = user RIP
+        Allocate,       // a = pool tag, b = address, c = size
+        Free,           // b = address, c = size if known
+        Wakeup,         // a = thread, b = ticks past its delay
+    };
+
+    struct TraceRecord
+    {
+        u64 tsc;
+        TraceType type;
+        u16 thread;     // Current thread when recorded
+        u32 a;
+        u64 b;
+        u64 c;
+    };
+    static_assert(sizeof(TraceRecord) == 32);
+
+    static constexpr u32 trace_records = 4096; // Per core, power of two
+
+#pragma data_seg(".data")
+    inline bool trace_enabled = false; // Off while the buffer is missing or being dumped
+#pragma data_seg()
+
+    INLINE void Trace(TraceType type, u32 a = 0, u64 b = 0, u64 c = 0)
+    {
+        if (!trace_enabled)
+            return;
+
+        auto core = GetCore();
+        const u32 index = __atomic_fetch_add(&core->trace_head, 1, __ATOMIC_RELAXED);
+        auto& record = core->trace_buffer[index & (trace_records - 1)];
+
+        record.tsc = __rdtsc();
+        record.type = type;
+        record.thread = core->current_thread ? ( u16 )core->current_thread->id : 0;
+        record.a = a;
+        record.b = b;
+        record.c = c;
+    }
+
+    // After InitializeCore.
+    void InitializeTrace();
+    // Gives a core its ring, before it runs anything that records.
+    void AllocateTraceBuffer(Core* core);
+    // Writes the ring of every online core to the serial port. Only from a thread, it waits for the port.
+    void DumpTrace();
+    // Dumps from a new thread, usable from interrupt handlers.
+    void RequestTraceDump();
+}
+
+#if KERNEL_TRACE
+#define TRACE(type, ...) ke::Trace(ke::TraceType::type __VA_OPT__(,) __VA_ARGS__)
+#else
+#define TRACE(type, ...) EMPTY_STMT
+#endif
@@ -0,0 +1,207 @@
+#include <ec/avl.h>
+#include <ec/new.h>
+#include <ec/util.h>
+
+#include "ke.h"
+
+//
+// Free extents are kept in an AVL tree ordered by base address.
+// Every node also stores the largest extent in its subtree, which lets
+// allocation find the lowest fitting extent without visiting the others.
+//
+
+namespace ke
+{
+    struct VaAllocator::Extent
+    {
+        ec::avl_entry<Extent> links;
+        vaddr_t base;
+        size_t size;
+        size_t max_size; // Largest extent in this subtree
+    };
+
+    using Extent = VaAllocator::Extent;
+
+    INLINE size_t MaxSize(Extent* node)
+    {
+        return node ? node->max_size : 0;
+    }
+
+    struct ExtentPolicy
+    {
+        INLINE static ec::avl_entry<Extent>& entry(Extent* node)
+        {
+            return node->links;
+        }
+
+        INLINE static bool less(const Extent* a, const Extent* b)
+        {
+            return a->base < b->base;
+        }
+
+        INLINE static void update(Extent* node)
+        {
+            node->max_size = ec::max(node->size, ec::max(MaxSize(node->links.left), MaxSize(node->links.right)));
+        }
+    };
+
+    using ExtentTree = ec::avl<Extent, ExtentPolicy>;
+
+    // Unlinks node from the tree and frees it, returning the subtree that replaces it.
+    static Extent* Remove(Extent* node)
+    {
+        auto rest = ExtentTree::remove(node);
+        delete node;
+        return rest;
+    }
+
+    static Extent* RemoveAt(Extent* node, vaddr_t base)
+    {
+        if (node->base == base)
+            return Remove(node);
+
+        if (base < node->base)
+            node->links.left = RemoveAt(node->links.left, base);
+        else
+            node->links.right = RemoveAt(node->links.right, base);
+
+        return ExtentTree::balance(node);
+    }
+
+    static Extent* Grow(Extent* node, vaddr_t base, size_t size)
+    {
+        if (node->base == base)
+            node->size += size;
+        else if (base < node->base)
+            node->links.left = Grow(node->links.left, base, size);
+        else
+            node->links.right = Grow(node->links.right, base, size);
+
+        ExtentTree::update(node);
+        return node;
+    }
+
+    //
+    // Carves total bytes aligned to alignment out of the lowest extent that is
+    // large enough (need includes the worst case alignment padding).
+    //
+    static Extent* TakeFirstFit(Extent* node, size_t need, size_t total, size_t alignment, vaddr_t& address)
+    {
+        if (MaxSize(node->links.left) >= need)
+        {
+            node->links.left = TakeFirstFit(node->links.left, need, total, alignment, address);
+            return ExtentTree::balance(node);
+        }
+
+        if (node->size < need)
+        {
+            node->links.right = TakeFirstFit(node->links.right, need, total, alignment, address);
+            return ExtentTree::balance(node);
+        }
+
+        address = (node->base + alignment - 1) & ~(alignment - 1);
+        const size_t head = address - node->base;
+        const size_t tail = node->size - head - total;
+
+        if (!head && !tail)
+            return Remove(node);
+
+        if (!head)
+        {
+            // The order doesn't change, the extent only moves up.
+            node->base += total;
+            node->size = tail;
+        }
+        else
+        {
+            node->size = head;
+            if (tail)
+                node->links.right = ExtentTree::insert(node->links.right, new (pool_tag::va_space) Extent{ .base = address + total, .size = tail });
+        }
+
+        return ExtentTree::balance(node);
+    }
+
+    void VaAllocator::Initialize(vaddr_t base, size_t size, size_t guard)
+    {
+        root = ExtentTree::insert(nullptr, new (pool_tag::va_space) Extent{ .base = base, .size = size });
+        region_base = base;
+        region_size = size;
+        guard_size = guard;
+        used = 0;
+    }
+
+    vaddr_t VaAllocator::Allocate(size_t size, size_t alignment)
+    {
+        if (!size)
+            return 0;
+
+        alignment = ec::max(alignment, page_size);
+        const size_t total = SizeToPages(size) * page_size + guard_size;
+        const size_t need = total + alignment - page_size;
+
+        SpinLockGuard guard(lock);
+
+        vaddr_t address = 0;
+        if (MaxSize(root) >= need)
+        {
+            root = TakeFirstFit(root, need, total, alignment, address);
+            used += total;
+        }
+
+        return address;
+    }
+
+    void VaAllocator::Free(vaddr_t address, size_t size)
+    {
+        const size_t total = SizeToPages(size) * page_size + guard_size;
+        const vaddr_t end = address + total;
+
+        if (address < region_base || end > region_base + region_size || !IsPageAligned(address))
+            Panic(Status::DoubleFree, address, size);
+
+        SpinLockGuard guard(lock);
+
+        // Find the free neighbours on both sides.
+        Extent* before = nullptr;
+        Extent* after = nullptr;
+        for (auto node = root; node;)
+        {
+            if (node->base < address)
+            {
+                before = node;
+                node = node->links.right;
+            }
+            else
+            {
+                after = node;
+                node = node->links.left;
+            }
+        }
+
+        if ((before && before->base + before->size > address) || (after && after->base < end))
+            Panic(Status::DoubleFree, address, size);
+
+        const bool merge_before = before && before->base + before->size == address;
+        const bool merge_after = after && after->base == end;
+
+        size_t grow = total;
+        if (merge_after)
+        {
+            grow += after->size;
+            root = RemoveAt(root, after->base);
+        }
+
+        if (merge_before)
+            root = Grow(root, before->base, grow);
+        else
+            root = ExtentTree::insert(root, new (pool_tag::va_space) Extent{ .base = address, .size = grow });
+
+        used -= total;
+    }
+
+    size_t VaAllocator::GetLargestFree() const
+    {
+        return MaxSize(root);
+    }
+}
@@ -27,8 +27,13 @@ namespace acpi
                 auto ptr = ( acpi::MadtLocalApic* )entry;
                 // Print("  PROCESSOR_LOCAL_APIC: ID %u Core ID %u Type %u Flags 0x%x\n",
                 //     ptr->ApicId, ptr->AcpiProcessorId, ptr->Type, ptr->Flags);
+                // Cores past max_cores are counted but never started.
                 if (ptr->Flags & ACPI_MADT_LAPIC_ENABLED)
+                {
+                    if (info.cores < x64::max_cores)
+                        info.apic_ids[info.cores] = ptr->ApicId;
                     info.cores++;
+                }
                 break;
             }
             case ACPI_MADT_IO_APIC:
@@ -55,6 +55,14 @@ INLINE void NO_REDEF__cpuidex(i32 regs[4], i32 leaf, i32 subleaf)
 }
 #define __cpuidex NO_REDEF__cpuidex // workaround
 
+INLINE u64 NO_REDEF__rdtsc()
+{
+    u32 low, high;
+    asm volatile("rdtsc" : "=a"(low), "=d"(high));
+    return MAKE64(high, low);
+}
+#define __rdtsc NO_REDEF__rdtsc // workaround
+
 INLINE void __wbinvd()
 {
     asm volatile("wbinvd" :: : "memory");
@@ -203,4 +211,41 @@ INLINE void __invlpg(void* addr)
 {
     asm volatile("invlpg (%0)" :: "r"(addr) : "memory");
 }
+
+INLINE u64 _xgetbv(u32 xcr)
+{
+    u32 low, high;
+    asm volatile("xgetbv" : "=a"(low), "=d"(high) : "c"(xcr));
+    return MAKE64(high, low);
+}
+
+INLINE void _xsetbv(u32 xcr, u64 value)
+{
+    asm volatile("xsetbv" :: "c"(xcr), "a"(LOW32(value)), "d"(HIGH32(value)) : "memory");
+}
+
+INLINE void _xsave64(void* area, u64 mask)
+{
+    asm volatile("xsave64 (%0)" :: "r"(area), "a"(LOW32(mask)), "d"(HIGH32(mask)) : "memory");
+}
+
+INLINE void _xsaveopt64(void* area, u64 mask)
+{
+    asm volatile("xsaveopt64 (%0)" :: "r"(area), "a"(LOW32(mask)), "d"(HIGH32(mask)) : "memory");
+}
+
+INLINE void _xrstor64(const void* area, u64 mask)
+{
+    asm volatile("xrstor64 (%0)" :: "r"(area), "a"(LOW32(mask)), "d"(HIGH32(mask)) : "memory");
+}
+
+INLINE void _fxsave64(void* area)
+{
+    asm volatile("fxsave64 (%0)" :: "r"(area) : "memory");
+}
+
+INLINE void _fxrstor64(const void* area)
+{
+    asm volatile("fxrstor64 (%0)" :: "r"(area) : "memory");
+}
 #endif
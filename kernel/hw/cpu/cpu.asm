@@ -29,9 +29,11 @@ extern kernel_stack_top
 
 section .text
 extern OsInitialize
+extern ApInitialize
 extern SyscallCxx
 
 global x64Entry
+global ApEntry
 global ReloadSegments
 global LoadTr
 global Ring3Function
@@ -52,6 +54,21 @@ x64Entry:
     sub rsp, 32
     jmp OsInitialize
 
+;
+; NO_RETURN void ApEntry(Core* core, paddr_t kernel_cr3)
+;
+; Application processor entry from the startup trampoline (see trampoline.asm).
+; The stack is already the core's idle thread stack.
+;
+; rcx = Core of this processor (used by ApInitialize)
+; rdx = Kernel page table root
+;
+ApEntry:
+    ; The trampoline page table only has the kernel half, the kernel one has everything.
+    mov cr3, rdx
+    sub rsp, 32
+    jmp ApInitialize
+
 ;
 ; void ReloadSegments(u16 code_selector, u16 data_selector)
 ;
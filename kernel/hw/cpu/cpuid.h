@@ -12,7 +12,10 @@ namespace x64
         VendorString = 0x0,
         Info = 0x1,
         ExtendedFeatures = 0x7,
+        ExtendedState = 0xd,
+        ExtendedMax = 0x80000000,
         ExtendedInfo = 0x80000001,
+        PowerManagement = 0x80000007,
     };
 
     enum class CpuidFeature
@@ -182,6 +185,9 @@ namespace x64
         LM = 1 << 29,
         _3DNOW_EXT = 1 << 30,
         _3DNOW = 1 << 31,
+
+        // EDX (leaf 0x80000007)
+        INVARIANT_TSC = 1 << 8,
     };
 
     union Cpuid
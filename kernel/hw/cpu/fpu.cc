@@ -0,0 +1,97 @@
+#include <libc/mem.h>
+
+#include "x64.h"
+#include "cpuid.h"
+#include "../../core/ke.h"
+#include "../gfx/output.h"
+
+namespace x64
+{
+    static constexpr size_t xstate_alignment = 64;
+
+    // Legacy region offsets, shared by the FXSAVE and XSAVE formats.
+    static constexpr size_t fcw_offset = 0;
+    static constexpr size_t mxcsr_offset = 24;
+    static constexpr u16 fcw_default = 0x37f;
+    static constexpr u32 mxcsr_default = 0x1f80;
+
+    EARLY void InitializeFpu()
+    {
+        Cpuid info(CpuidLeaf::Info);
+        cpu_info.xsave_supported = CheckCpuid(info.ecx, CpuidFeature::XSAVE);
+
+        auto cr4 = ReadCr4() | Cr4::OSFXSR | Cr4::OSXMMEXCPT;
+        if (cpu_info.xsave_supported)
+            cr4 |= Cr4::OSXSAVE;
+        WriteCr4(cr4);
+
+        if (cpu_info.xsave_supported)
+        {
+            Cpuid state(CpuidLeaf::ExtendedState);
+
+            // AVX-512 components can only be enabled together.
+            xstate_mask = (xstate_x87 | xstate_sse | xstate_avx | xstate_avx512) & ( u32 )state.eax;
+            if ((xstate_mask & xstate_avx512) != xstate_avx512)
+                xstate_mask &= ~xstate_avx512;
+
+            _xsetbv(0, xstate_mask);
+
+            // EBX is the size needed for the components currently enabled in XCR0.
+            xstate_size = ( u32 )Cpuid(CpuidLeaf::ExtendedState).ebx;
+            cpu_info.xsaveopt_supported = Cpuid(CpuidLeaf::ExtendedState, 1).eax & 1;
+        }
+
+        Print(
+            "FPU: %s, components 0x%llx, %llu byte save area\n",
+            cpu_info.xsaveopt_supported ? "XSAVEOPT" : cpu_info.xsave_supported ? "XSAVE" : "FXSAVE",
+            xstate_mask,
+            xstate_size
+        );
+
+        // Nothing owns the registers yet, the first user traps.
+        SetTaskSwitched(true);
+    }
+
+    void* AllocateFpuState()
+    {
+        // Leave room to align the area and to remember where the allocation starts.
+        auto buffer = ( u8* )ke::Allocate(xstate_size + xstate_alignment + sizeof(void*), ke::pool_tag::fpu);
+        if (!buffer)
+            return nullptr;
+
+        auto area = ( u8* )((( uptr_t )buffer + sizeof(void*) + xstate_alignment - 1) & ~(xstate_alignment - 1));
+        (( void** )area)[-1] = buffer;
+
+        // A zero XSAVE header means every component starts in its initial state.
+        // The control words are loaded from the legacy region either way.
+        memzero(area, xstate_size);
+        *( u16* )(area + fcw_offset) = fcw_default;
+        *( u32* )(area + mxcsr_offset) = mxcsr_default;
+
+        return area;
+    }
+
+    void FreeFpuState(void* area)
+    {
+        if (area)
+            ke::Free((( void** )area)[-1]);
+    }
+
+    void SaveFpuState(void* area)
+    {
+        if (cpu_info.xsaveopt_supported)
+            _xsaveopt64(area, xstate_mask);
+        else if (cpu_info.xsave_supported)
+            _xsave64(area, xstate_mask);
+        else
+            _fxsave64(area);
+    }
+
+    void RestoreFpuState(const void* area)
+    {
+        if (cpu_info.xsave_supported)
+            _xrstor64(area, xstate_mask);
+        else
+            _fxrstor64(area);
+    }
+}
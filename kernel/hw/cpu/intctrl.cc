@@ -6,6 +6,7 @@
 #include "msr.h"
 #include "../timer/timer.h"
 #include "../../core/ke.h"
+#include "../../core/trace.h"
 
 // #define DEBUG_CTX_SWITCH
 
@@ -66,11 +67,53 @@ namespace x64
 
     EXTERN_C u64 spurious_irqs = 0;
 
+    // Set when a time slice ended or a thread that should run before the current one became ready.
+    static void SwitchIfNeeded(InterruptFrame* frame)
+    {
+        auto core = ke::GetCore();
+        if (!core->need_resched || !ke::schedule || core->preempt_count)
+            return;
+
+        auto prev = ke::GetCurrentThread();
+
+        if (ke::SelectNextThread())
+        {
+            auto next = ke::GetCurrentThread();
+
+            // Save old context
+            prev->context = *frame;
+
+            // Switch to new context
+            *frame = next->context;
+
+            DbgPrint(
+                "Thread switch\n"
+                "  From id %llu to id %llu\n"
+                "  RSP0: 0x%p RSP3: 0x%p\n"
+                "  Set new RSP to 0x%p\n"
+                "  TSS0 RSP is 0x%p\n",
+                prev->id, next->id,
+                next->context.rsp, next->user_stack,
+                frame->rsp,
+                ke::GetCore()->tss->rsp0
+            );
+        }
+    }
+
     EXTERN_C void IsrCommon(InterruptFrame* frame, u8 int_no)
     {
         if (int_no < irq_base)
         {
-            if (int_no == 14)
+            if (int_no == 7)
+            {
+                // Device not available, the FPU state has to be switched.
+                ke::HandleFpuTrap();
+            }
+            else if (int_no == 2 && ke::HandleTlbShootdown())
+            {
+                // Another core changed kernel mappings.
+            }
+            else if (int_no == 14)
             {
                 auto present = frame->error_code & 1 ? "present" : "not present";
                 auto op = frame->error_code & 2 ? "write" : "read";
@@ -100,44 +143,35 @@ namespace x64
             u8 irq = int_no - irq_base;
             if (cpu_info.using_apic || pic::ConfirmIrq(irq))
             {
-                if (irq == 0 && (timer::ticks % 10) == 0 && ke::schedule)
-                {
-                    auto prev = ke::GetCurrentThread();
-
-                    if (ke::SelectNextThread())
-                    {
-                        auto next = ke::GetCurrentThread();
-
-                        // Save old context
-                        prev->context = *frame;
-
-                        // Switch to new context
-                        *frame = next->context;
-
-                        DbgPrint(
-                            "Thread switch\n"
-                            "  From id %llu to id %llu\n"
-                            "  RSP0: 0x%p RSP3: 0x%p\n"
-                            "  Set new RSP to 0x%p\n"
-                            "  TSS0 RSP is 0x%p\n",
-                            prev->id, next->id,
-                            next->context.rsp, next->user_stack,
-                            frame->rsp,
-                            ke::GetCore()->tss->rsp0
-                        );
-                    }
-                }
+                TRACE(IrqEnter, irq);
 
+                // Handlers first, a tick after the tick was stopped has to catch up before scheduling.
                 if (irq_handlers[irq])
                     irq_handlers[irq]();
 
+                SwitchIfNeeded(frame);
+
                 send_eoi(irq);
+                TRACE(IrqExit, irq);
             }
             else // PIC and spurious
             {
                 spurious_irqs++;
             }
         }
+        else if (int_no == apic::timer_int_vec || int_no == apic::resched_int_vec)
+        {
+            // Local APIC interrupts, legacy IRQs only reach the boot processor.
+            TRACE(IrqEnter, int_no);
+
+            if (int_no == apic::timer_int_vec)
+                timer::LocalIsr();
+
+            SwitchIfNeeded(frame);
+
+            apic::SendEoi(int_no);
+            TRACE(IrqExit, int_no);
+        }
         else
         {
             Print("IsrCommon: Unexpected interrupt %u.\n", int_no);
@@ -150,6 +184,84 @@ namespace apic
 {
     static u32 max_irq;
 
+    static constexpr u32 icr_pending = 1 << 12;
+    static constexpr u32 icr_assert = 1 << 14;
+    static constexpr u32 timer_divide_16 = 0b0011;
+    static constexpr u32 timer_one_shot = 0;
+    static constexpr u32 timer_periodic = 1;
+    static constexpr u64 timer_calibration_ns = 10'000'000;
+
+#pragma data_seg(".data")
+    static u32 timer_counts_per_tick = 0;
+#pragma data_seg()
+
+    void SendIpi(u8 apic_id, Delivery delivery, u8 vector)
+    {
+        // Both halves are written by the same core, an interrupt in between could send its own IPI.
+        const bool prev = x64::DisableInterrupts();
+
+        // Writing the low half sends it.
+        WriteLocal(LocalReg::ICR1, ( u32 )apic_id << 24);
+        WriteLocal(LocalReg::ICR0, icr_assert | ( u32 )delivery << 8 | vector);
+
+        while (ReadLocal(LocalReg::ICR0) & icr_pending)
+            _mm_pause();
+
+        if (prev)
+            x64::EnableInterrupts();
+    }
+
+    // Timer counts per tick, measured against ke::Now(). Every core's timer runs at the same rate.
+    static u32 CalibrateLocalTimer()
+    {
+        WriteLocal(LocalReg::TICR, ec::umax_v<u32>);
+        const u64 start = ke::Now();
+
+        u64 elapsed;
+        while ((elapsed = ke::Now() - start) < timer_calibration_ns)
+            _mm_pause();
+
+        const u32 counted = ec::umax_v<u32> - ReadLocal(LocalReg::TCCR);
+        WriteLocal(LocalReg::TICR, 0);
+
+        return ( u32 )(( u64 )counted * (1'000'000'000 / timer::hpet::hz) / elapsed);
+    }
+
+    static void StartLocalTimer(u32 mode, u32 count)
+    {
+        LvtEntry timer{};
+        timer.vector = timer_int_vec;
+        timer.timer_mode = mode;
+        WriteLocal(LocalReg::TMR_LVTR, timer.bits);
+        WriteLocal(LocalReg::TICR, count);
+    }
+
+    void InitializeLocal()
+    {
+        // The LVT entries are still masked after INIT.
+        UnmaskInterrupts();
+        WriteLocal(LocalReg::TPR, 0);
+        WriteLocal(LocalReg::TDCR, timer_divide_16);
+
+        if (!timer_counts_per_tick)
+        {
+            timer_counts_per_tick = CalibrateLocalTimer();
+            Print("Local APIC timer: %u counts per tick\n", timer_counts_per_tick);
+        }
+
+        SetLocalPeriodic();
+    }
+
+    void SetLocalPeriodic()
+    {
+        StartLocalTimer(timer_periodic, timer_counts_per_tick);
+    }
+
+    void SetLocalOneShot(u64 ticks)
+    {
+        StartLocalTimer(timer_one_shot, ( u32 )ec::min<u64>(ticks * timer_counts_per_tick, ec::umax_v<u32>));
+    }
+
     void UpdateLvtEntry(LocalReg reg, u8 vector, Delivery type, bool enable)
     {
         if (vector < 16)
@@ -146,6 +146,8 @@ namespace apic
         0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15
     };
     constexpr u8 spurious_int_vec = 255;
+    constexpr u8 timer_int_vec = 254;   // Local timer tick of the application processors
+    constexpr u8 resched_int_vec = 253; // Another core queued a thread that should run now
 
     INLINE u32 ReadLocal(LocalReg reg)
     {
@@ -198,7 +200,23 @@ namespace apic
         WriteLocal(LocalReg::SIVR, ( u32 )SivrFlag::ApicEnable | spurious_int_vec);
     }
 
-    // TODO - apic timer update function
+    INLINE u8 GetId()
+    {
+        return ( u8 )(ReadLocal(LocalReg::ID) >> 24);
+    }
+
+    // Fixed IPIs go to vector, startup IPIs start the core at physical page vector.
+    void SendIpi(u8 apic_id, Delivery delivery, u8 vector = 0);
+
+    //
+    // Enables the local APIC of an application processor and starts its timer,
+    // interrupting at timer::hpet::hz like the boot processor's tick.
+    //
+    void InitializeLocal();
+
+    // Writing the initial count restarts the timer. A one-shot interrupt comes after the given ticks.
+    void SetLocalPeriodic();
+    void SetLocalOneShot(u64 ticks);
 
     void UpdateLvtEntry(LocalReg reg, u8 vector, Delivery type, bool enable);
 
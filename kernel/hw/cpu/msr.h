@@ -8,6 +8,7 @@
 #define WriteMsr(msr, x) __writemsr(( u32 )msr, ( u64 )x)
 
 #define EFER_SCE (1 << 0)
+#define EFER_LMA (1 << 10)
 
 #define APIC_BSP (1 << 8)
 #define APIC_GLOBAL_ENABLE (1 << 11)
@@ -0,0 +1,124 @@
+;
+; Application processor startup, see ke::StartProcessors.
+;
+; The code is copied to a page below 1 MiB and a startup IPI starts a core at its
+; first byte in real mode. It goes through protected mode into long mode on the
+; temporary page table from the startup block and jumps to the kernel entry.
+; Nothing may be addressed absolutely, only relative to ApTrampoline.
+;
+
+struc ApStartup
+    .page_table  resd 1 ; Identity maps the trampoline, shares the kernel half
+    .efer        resd 1 ; Low half of the boot processor's EFER
+    .kernel_cr3  resq 1
+    .entry       resq 1 ; Called with rcx = core, rdx = kernel_cr3
+    .stack       resq 1
+    .core        resq 1
+endstruc
+
+%define REL(x) ((x) - ApTrampoline)
+
+CODE32_SEL equ 1*8
+DATA_SEL   equ 2*8
+CODE64_SEL equ 3*8
+
+CR0_PE  equ 1 << 0
+CR0_PG  equ 1 << 31
+CR4_PAE equ 1 << 5
+MSR_EFER equ 0xc0000080
+
+section .text
+
+global ApTrampoline
+global ApTrampolineStartup
+global ApTrampolineEnd
+
+bits 16
+ApTrampoline:
+    cli
+    cld
+
+    mov ax, cs
+    mov ds, ax
+    movzx ebx, ax
+    shl ebx, 4 ; ebx = physical address of the trampoline
+
+    ; The GDT pointer and the far jumps need physical addresses.
+    lea eax, [ebx + REL(TrampolineGdt)]
+    mov [REL(TrampolineGdtr) + 2], eax
+    lea eax, [ebx + REL(ApProtectedMode)]
+    mov [REL(ProtectedJump)], eax
+    lea eax, [ebx + REL(ApLongMode)]
+    mov [REL(LongJump)], eax
+
+    o32 lgdt [REL(TrampolineGdtr)]
+
+    mov eax, cr0
+    or eax, CR0_PE
+    mov cr0, eax
+
+    o32 jmp far [REL(ProtectedJump)]
+
+bits 32
+ApProtectedMode:
+    mov ax, DATA_SEL
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+    mov ss, ax
+
+    mov eax, cr4
+    or eax, CR4_PAE
+    mov cr4, eax
+
+    mov eax, [ebx + REL(ApTrampolineStartup) + ApStartup.page_table]
+    mov cr3, eax
+
+    ; Long mode and whatever else the boot processor enabled, NX in particular.
+    mov ecx, MSR_EFER
+    mov eax, [ebx + REL(ApTrampolineStartup) + ApStartup.efer]
+    xor edx, edx
+    wrmsr
+
+    mov eax, cr0
+    or eax, CR0_PG
+    mov cr0, eax
+
+    jmp far [ebx + REL(LongJump)]
+
+bits 64
+ApLongMode:
+    mov ebx, ebx
+
+    mov rsp, [rbx + REL(ApTrampolineStartup) + ApStartup.stack]
+    mov rcx, [rbx + REL(ApTrampolineStartup) + ApStartup.core]
+    mov rdx, [rbx + REL(ApTrampolineStartup) + ApStartup.kernel_cr3]
+    jmp qword [rbx + REL(ApTrampolineStartup) + ApStartup.entry]
+
+align 8
+TrampolineGdt:
+    dq 0
+    dq 0x00cf9a000000ffff ; 32-bit code
+    dq 0x00cf92000000ffff ; Data
+    dq 0x00af9a000000ffff ; 64-bit code
+TrampolineGdtEnd:
+
+TrampolineGdtr:
+    dw TrampolineGdtEnd - TrampolineGdt - 1
+    dd 0
+
+ProtectedJump:
+    dd 0
+    dw CODE32_SEL
+
+LongJump:
+    dd 0
+    dw CODE64_SEL
+
+align 8
+ApTrampolineStartup:
+    istruc ApStartup
+    iend
+
+ApTrampolineEnd:
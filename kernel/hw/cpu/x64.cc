@@ -1,8 +1,11 @@
+#include <ec/bitmap.h>
+
 #include "x64.h"
 #include "cpuid.h"
 #include "isr.h"
 #include "msr.h"
 #include "../../core/ke.h"
+#include "../../core/trace.h"
 #include "../gfx/output.h"
 
 namespace x64
@@ -285,6 +288,40 @@ namespace x64
     };
 #pragma data_seg()
 
+#pragma data_seg(".data")
+    static ec::const_bitmap<u64, 4096 / 64> pcid_map;
+    // What Initialize left in the control registers, application processors copy it.
+    static Cr0 boot_cr0 = Cr0::PE;
+    static Cr4 boot_cr4 = Cr4::PAE;
+#pragma data_seg()
+
+    u16 AllocatePcid()
+    {
+        if (!cpu_info.pcid_supported)
+            return 0;
+
+        bool prev = DisableInterrupts();
+
+        // PCID 0 is what the bootloader ran with. It is also shared by every
+        // table once all others are in use, so it is flushed on every load.
+        auto pcid = pcid_map.find_first_clear(1);
+        if (pcid == pcid_map.npos)
+            pcid = 0;
+        else
+            pcid_map.set_bit(pcid);
+
+        if (prev)
+            EnableInterrupts();
+
+        return ( u16 )pcid;
+    }
+
+    void FreePcid(u16 pcid)
+    {
+        if (pcid)
+            pcid_map.clear_bit(pcid);
+    }
+
     EARLY static void GetCpuModel()
     {
         Print("CPU vendor: %s\n", GetVendorString(cpu_info.vendor_string));
@@ -333,7 +370,7 @@ namespace x64
         {
             Cpuid ids(CpuidLeaf::Info);
 
-            CheckOptionalFeature(cpu_info.tsc_supported, ids.ecx, TSC);
+            CheckOptionalFeature(cpu_info.tsc_supported, ids.edx, TSC);
             CheckOptionalFeature(cpu_info.hypervisor, ids.ecx, HYPERVISOR);
             CheckOptionalFeature(cpu_info.has_x2apic, ids.ecx, X2APIC);
 
@@ -345,15 +382,34 @@ namespace x64
             Cpuid ids(CpuidLeaf::ExtendedInfo);
 
             CheckRequiredFeature(ids.edx, SYSCALL);
+            CheckOptionalFeature(cpu_info.huge_pages_supported, ids.edx, PDPE1GB);
+        }
+
+        cpu_info.invariant_tsc = false;
+        if (( u32 )Cpuid(CpuidLeaf::ExtendedMax).eax >= ( u32 )CpuidLeaf::PowerManagement)
+        {
+            Cpuid ids(CpuidLeaf::PowerManagement);
+
+            CheckOptionalFeature(cpu_info.invariant_tsc, ids.edx, INVARIANT_TSC);
+        }
+
+        {
+            Cpuid ids(CpuidLeaf::ExtendedFeatures);
+
+            CheckOptionalFeature(cpu_info.fast_strings, ids.ebx, ERMS);
+            CheckOptionalFeature(cpu_info.fast_short_strings, ids.edx, FSRM);
         }
 
         Print("\n");
+
+        SetMemoryFeatures(cpu_info.fast_strings, cpu_info.fast_short_strings);
     }
 
     EARLY static void SetCr0Bits()
     {
         // TODO - set ET?
-        WriteCr0(ReadCr0() & ~(Cr0::MP | Cr0::NE));
+        // MP makes WAIT honor TS, NE reports x87 errors as #MF instead of through the PIC.
+        WriteCr0((ReadCr0() | Cr0::MP | Cr0::NE) & ~Cr0::EM);
     }
 
     EARLY static void SetCr4Bits()
@@ -363,6 +419,25 @@ namespace x64
 
         Print("CR4: ");
 
+        {
+            Cpuid info(CpuidLeaf::Info);
+
+            if (CheckCpuid(info.edx, CpuidFeature::PGE))
+            {
+                cr4 |= Cr4::PGE;
+                Print("PGE ");
+            }
+
+            cpu_info.pcid_supported = CheckCpuid(info.ecx, CpuidFeature::PCID);
+            if (cpu_info.pcid_supported)
+            {
+                // PCIDE can only be set while CR3[11:0] is 0.
+                __writecr3(__readcr3() & ~page_mask);
+                cr4 |= Cr4::PCIDE;
+                Print("PCIDE ");
+            }
+        }
+
         if (CheckCpuid(ids.ebx, CpuidFeature::FSGSBASE))
         {
             cr4 |= Cr4::FSGSBASE;
@@ -403,7 +478,7 @@ namespace x64
         Uncached = 0x07, // (UC-) PAT only, reserved on MTRRs
     };
 
-    EARLY static void LoadPageAttributeTable()
+    static void LoadPageAttributeTable()
     {
         // This is the same as the default PAT entries
         // but with one exception: PAT4 selects WC instead of WB
@@ -417,30 +492,31 @@ namespace x64
             | (MemoryType::Uncached << 48)       // PAT6: UC-
             | (MemoryType::Uncacheable << 56));  // PAT7: UC+
 
-        TlbFlush();
+        TlbFlushAll();
         __wbinvd();
         WriteMsr(Msr::PAT, pat_entries);
         __wbinvd();
-        TlbFlush();
+        TlbFlushAll();
     }
 
-    EARLY static void LoadGdt(x64::DescriptorTable* desc)
+    static void LoadGdt(x64::DescriptorTable* desc)
     {
         _lgdt(( uptr_t* )desc);
         ReloadSegments(GetGdtOffset(GdtIndex::R0Code), GetGdtOffset(GdtIndex::R0Data));
         LoadTr(GetGdtOffset(GdtIndex::TssLow));
     }
 
-    EARLY static void LoadIdt(x64::DescriptorTable* desc)
+    static void LoadIdt(x64::DescriptorTable* desc)
     {
-        if (cpu_info.using_apic)
-            idt[apic::spurious_int_vec].Set(_IsrSpurious, 0);
-
         __lidt(( uptr_t* )desc);
     }
 
     EARLY static void LoadDescriptorTables()
     {
+        // The other cores always run with their local APIC enabled.
+        if (cpu_info.using_apic || cpu_info.cores > 1)
+            idt[apic::spurious_int_vec].Set(_IsrSpurious, 0);
+
         DescriptorTable gdt_desc(&gdt, sizeof gdt - 1);
         LoadGdt(&gdt_desc);
 
@@ -479,7 +555,7 @@ namespace x64
         EnableNmi();
     }
 
-    EARLY void InitializeSyscalls()
+    void InitializeSyscalls()
     {
         MsrStar star{};
 
@@ -537,6 +613,7 @@ namespace x64
 
     EXTERN_C u64 SyscallCxx(SyscallFrame* frame, u64 sys_no)
     {
+        TRACE(Syscall, ( u32 )sys_no, frame->rcx);
         Print("Syscall number: 0x%llx\n", sys_no);
 
         // TODO - call into a table from asm instead
@@ -560,6 +637,7 @@ namespace x64
         CheckFeatureSupport();
         SetCr0Bits();
         SetCr4Bits();
+        InitializeFpu();
 
         LoadPageAttributeTable();
         LoadDescriptorTables();
@@ -567,5 +645,32 @@ namespace x64
         InitializeInterrupts();
 
         InitializeSyscalls();
+
+        boot_cr0 = ReadCr0();
+        boot_cr4 = ReadCr4();
+    }
+
+    void InitializeProcessor(GdtEntry* core_gdt, Tss* tss)
+    {
+        // INIT leaves the caches disabled, the boot value turns them back on.
+        WriteCr0(boot_cr0);
+        WriteCr4(boot_cr4);
+        if (cpu_info.xsave_supported)
+            _xsetbv(0, xstate_mask);
+
+        LoadPageAttributeTable();
+
+        for (size_t i = 0; i < gdt.size(); i++)
+            core_gdt[i] = gdt[i];
+        core_gdt[( size_t )GdtIndex::TssLow] = GdtEntry::TssLow(tss);
+        core_gdt[( size_t )GdtIndex::TssHigh] = GdtEntry::TssHigh(tss);
+
+        DescriptorTable gdt_desc(core_gdt, sizeof gdt - 1);
+        LoadGdt(&gdt_desc);
+
+        DescriptorTable idt_desc(&idt, sizeof idt - 1);
+        LoadIdt(&idt_desc);
+
+        InitializeSyscalls();
     }
 }
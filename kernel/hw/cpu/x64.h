@@ -101,6 +101,8 @@ namespace x64
         __writecr4(ec::to_underlying(flags));
     }
 
+    static constexpr u32 max_cores = 16;
+
     struct ProcessorInfo
     {
         char vendor_string[13];
@@ -108,6 +110,7 @@ namespace x64
         u8 model;
         u8 family;
         u8 cores;
+        u8 apic_ids[max_cores]; // Enabled local APICs in MADT order, the boot processor included
         union
         {
             struct
@@ -117,8 +120,15 @@ namespace x64
                 bool has_x2apic;
                 bool apic_nmi_pin; // LINT0/LINT1
                 bool tsc_supported;
+                bool invariant_tsc; // Constant rate in every P-, C- and T-state
                 bool smap_supported;
                 bool hypervisor;
+                bool huge_pages_supported; // 1 GiB pages
+                bool pcid_supported;
+                bool fast_strings; // ERMS
+                bool fast_short_strings; // FSRM
+                bool xsave_supported;
+                bool xsaveopt_supported;
             };
             u32 support_flags;
         };
@@ -302,6 +312,12 @@ namespace x64
 
     alignas(64) extern const ec::array<GdtEntry, 8> gdt;
 
+    //
+    // Sets up an application processor the way Initialize did the boot processor.
+    // It gets its own copy of the GDT pointing at tss and shares the IDT.
+    //
+    void InitializeProcessor(GdtEntry* core_gdt, Tss* tss);
+
     enum class GdtIndex
     {
         Null,
@@ -516,13 +532,123 @@ namespace x64
 
     INLINE void TlbFlush()
     {
-        // Reloading CR3 invalidates all non-global TLB entries
+        // Reloading CR3 invalidates all non-global TLB entries of the current PCID
         __writecr3(__readcr3());
     }
 
+    INLINE void TlbFlushAll()
+    {
+        // Any change to CR4.PGE invalidates every TLB entry, including global ones and all PCIDs
+        const auto cr4 = ReadCr4();
+        WriteCr4(cr4 ^ Cr4::PGE);
+        WriteCr4(cr4);
+    }
+
+    static constexpr u64 cr3_no_flush = 1ULL << 63;
+
+    u16 AllocatePcid();
+    void FreePcid(u16 pcid);
+
+    //
+    // Loads a page table root. With PCIDs, TLB entries tagged with pcid
+    // survive the switch unless flush is set.
+    //
+    INLINE void LoadCr3(uptr_t root, u16 pcid, bool flush)
+    {
+        if (!cpu_info.pcid_supported)
+            __writecr3(root);
+        else
+            __writecr3(root | pcid | (flush ? 0 : cr3_no_flush));
+    }
+
     INLINE void TlbFlushAddress(void* addr)
     {
         __invlpg(addr);
-        // TODO - make MP compatible with APIC IPIs
+        // Only this core, shared kernel mappings need ke::ShootdownKernelTlb as well.
+    }
+
+    //
+    // Collects addresses whose translations changed so they can be invalidated together.
+    // Up to flush_threshold entries are invalidated one by one with INVLPG, past that
+    // a full flush is cheaper. It only drops every PCID and global entry if a kernel
+    // address was added, otherwise it only flushes the current PCID.
+    // Anything the old translations pointed to (like page frames) must not be reused
+    // before Flush() has been called.
+    //
+    class TlbGather
+    {
+    public:
+        static constexpr size_t flush_threshold = 33;
+
+        TlbGather() = default;
+        TlbGather(const TlbGather&) = delete;
+        TlbGather& operator=(const TlbGather&) = delete;
+
+        ~TlbGather()
+        {
+            Flush();
+        }
+
+        // Adds a single TLB entry, of any page size.
+        void Add(vaddr_t virt)
+        {
+            global |= virt >= kernel_half_base;
+            if (count < flush_threshold)
+                addresses[count] = virt;
+            count++;
+        }
+
+        void Flush()
+        {
+            if (count > flush_threshold)
+            {
+                if (global)
+                    TlbFlushAll();
+                else
+                    TlbFlush();
+            }
+            else
+            {
+                for (size_t i = 0; i < count; i++)
+                    TlbFlushAddress(( void* )addresses[i]);
+            }
+
+            count = 0;
+            global = false;
+        }
+
+    private:
+        vaddr_t addresses[flush_threshold];
+        size_t count = 0;
+        bool global = false;
+    };
+
+    //
+    // Extended register state (x87, SSE, AVX...).
+    // The kernel itself is built without it, so it is only switched lazily:
+    // CR0.TS is set whenever a thread that doesn't own the registers runs,
+    // and its first SIMD instruction raises #NM so the state can be swapped.
+    //
+    static constexpr u64 xstate_x87 = 1 << 0;
+    static constexpr u64 xstate_sse = 1 << 1;
+    static constexpr u64 xstate_avx = 1 << 2;
+    static constexpr u64 xstate_avx512 = 7 << 5; // Opmask, ZMM_Hi256, Hi16_ZMM
+
+    inline u64 xstate_mask;              // Components enabled in XCR0
+    inline size_t xstate_size = 512;     // Bytes per save area, FXSAVE format without XSAVE
+
+    EARLY void InitializeFpu();
+
+    // Save areas are 64 byte aligned and start out in the initial state.
+    void* AllocateFpuState();
+    void FreeFpuState(void* area);
+    void SaveFpuState(void* area);
+    void RestoreFpuState(const void* area);
+
+    INLINE void SetTaskSwitched(bool set)
+    {
+        const auto cr0 = ReadCr0();
+        if (( bool )(cr0 & Cr0::TS) != set)
+            WriteCr0(set ? cr0 | Cr0::TS : cr0 & ~Cr0::TS);
     }
 }
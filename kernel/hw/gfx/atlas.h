@@ -0,0 +1,102 @@
+#pragma once
+
+#include <base.h>
+#include <ec/array.h>
+
+#include "font.h"
+
+//
+// The console font's first glyphs, decoded from FONT at compile time into one
+// byte per glyph row (bit 0 is the leftmost pixel).
+// Decoding follows ssfn_putc: the characters table is walked once, and every
+// bitmap fragment of a glyph is copied to its row. Glyphs with wider fragments
+// or outside the atlas are left to ssfn_putc.
+//
+namespace gfx
+{
+    static constexpr u32 glyph_width = FONT[10];
+    static constexpr u32 glyph_height = FONT[11];
+    static constexpr u32 atlas_glyphs = 256;
+
+    static_assert(glyph_width == 8, "Glyph rows are stored as bytes");
+
+    struct GlyphAtlas
+    {
+        ec::array<ec::array<u8, glyph_height>, atlas_glyphs> rows;
+        ec::array<bool, atlas_glyphs> present;
+    };
+
+    static constexpr auto glyph_atlas = []()
+    {
+        GlyphAtlas atlas{};
+
+        auto read = [](u32 offset, u32 bytes)
+        {
+            u32 value = 0;
+            for (u32 i = 0; i < bytes; i++)
+                value |= ( u32 )FONT[offset + i] << (i * 8);
+            return value;
+        };
+
+        u32 ptr = read(16, 4); // characters_offs
+
+        for (u32 ch = 0; ch < atlas_glyphs; ch++)
+        {
+            // Skip records, same encoding as in ssfn_putc.
+            if (FONT[ptr] == 0xff)
+            {
+                ch += 0xffff;
+                ptr++;
+                continue;
+            }
+            if ((FONT[ptr] & 0xc0) == 0xc0)
+            {
+                ch += ((FONT[ptr] & 0x3f) << 8) | FONT[ptr + 1];
+                ptr += 2;
+                continue;
+            }
+            if ((FONT[ptr] & 0xc0) == 0x80)
+            {
+                ch += FONT[ptr] & 0x3f;
+                ptr++;
+                continue;
+            }
+
+            const u32 chr = ptr;
+            const bool wide_offsets = FONT[chr] & 0x40;
+            const u32 record_size = wide_offsets ? 6 : 5;
+            bool usable = FONT[chr + 3] <= glyph_height;
+
+            for (u32 i = 0, frag = chr + 6; i < FONT[chr + 1] && usable; i++, frag += record_size)
+            {
+                if (FONT[frag] == 0xff && FONT[frag + 1] == 0xff)
+                    continue;
+
+                const u32 frg = read(frag + 2, wide_offsets ? 4 : 3);
+                if ((FONT[frg] & 0xe0) != 0x80)
+                    continue;
+
+                const u32 row_bytes = (FONT[frg] & 0x1f) + 1;
+                const u32 lines = FONT[frg + 1] + 1;
+                const u32 y = FONT[frag + 1];
+
+                if (row_bytes != 1 || y + lines > glyph_height)
+                {
+                    usable = false;
+                    break;
+                }
+
+                for (u32 line = 0; line < lines; line++)
+                    atlas.rows[ch][y + line] |= FONT[frg + 2 + line];
+            }
+
+            atlas.present[ch] = usable;
+            if (!usable)
+                atlas.rows[ch] = {};
+
+            ptr += 6 + FONT[chr + 1] * record_size;
+        }
+
+        return atlas;
+    }();
+}
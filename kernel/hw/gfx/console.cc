@@ -0,0 +1,304 @@
+#include "console.h"
+#include "output.h"
+
+#include "atlas.h"
+#define SSFN_CONSOLEBITMAP_TRUECOLOR
+#include "ssfn.h"
+
+#include "../../core/ke.h"
+#include <libc/mem.h>
+
+namespace gfx::console
+{
+    struct Cell
+    {
+        u32 ch;     // Anything up to a space is blank
+        u32 color;
+    };
+
+    static constexpr u32 tab_width = 8;
+    static constexpr u32 cell_width = glyph_width;
+    static constexpr u32 cell_height = glyph_height;
+
+    static constexpr u8 blank_glyph[glyph_height]{};
+
+    typedef u64 __attribute__((aligned(4), may_alias)) pixel_pair;
+
+#pragma data_seg(".data")
+    static u8* frame_buffer = nullptr;
+    static u32 width = 0;           // Pixels
+    static u32 height = 0;
+    static u32 pitch = 0;           // Bytes per framebuffer line
+
+    static u32 columns = 0;
+    static u32 rows = 0;
+
+    static u32 cursor_x = 0;        // Column
+    static u32 cursor_y = 0;        // Screen row
+    static u32 fg = 0;
+    static u32 bg = 0;
+
+    // Shadow state, indexed by physical row unless noted otherwise.
+    static Cell* cells = nullptr;
+    static u32* shadow = nullptr;
+    static bool* render_pending = nullptr;  // Cells changed since the row was last rendered
+    static bool* copy_pending = nullptr;    // By screen row, the framebuffer is out of date
+    static u32 top_row = 0;                 // Physical row at the top of the screen
+#pragma data_seg()
+
+    INLINE size_t ShadowStride()
+    {
+        return width * sizeof(u32);
+    }
+
+    INLINE u32 PhysicalRow(u32 y)
+    {
+        y += top_row;
+        return y >= rows ? y - rows : y;
+    }
+
+    INLINE u8* ShadowRow(u32 row)
+    {
+        return ( u8* )shadow + ( size_t )row * cell_height * ShadowStride();
+    }
+
+    INLINE u8* FrameBufferRow(u32 y)
+    {
+        return frame_buffer + ( size_t )y * cell_height * pitch;
+    }
+
+    static void FillRect(u8* dst, size_t stride, u32 w, u32 h, u32 color)
+    {
+        for (u32 y = 0; y < h; y++, dst += stride)
+        {
+            if (!color)
+            {
+                memzero(dst, w * sizeof(u32));
+                continue;
+            }
+
+            auto line = ( u32* )dst;
+            for (u32 x = 0; x < w; x++)
+                line[x] = color;
+        }
+    }
+
+    // Two pixels per store, picked by two bits of the glyph row.
+    static void BlitGlyph(u8* row, size_t stride, u32 column, const u8* glyph, u32 color)
+    {
+        const pixel_pair pairs[]{
+            bg | ( u64 )bg << 32,
+            color | ( u64 )bg << 32,
+            bg | ( u64 )color << 32,
+            color | ( u64 )color << 32,
+        };
+
+        row += column * cell_width * sizeof(u32);
+        for (u32 y = 0; y < cell_height; y++, row += stride)
+        {
+            const u8 bits = glyph[y];
+            auto p = ( pixel_pair* )row;
+            p[0] = pairs[bits & 3];
+            p[1] = pairs[(bits >> 2) & 3];
+            p[2] = pairs[(bits >> 4) & 3];
+            p[3] = pairs[bits >> 6];
+        }
+    }
+
+    static void DrawCell(u8* row, size_t stride, u32 column, u32 ch, u32 color)
+    {
+        if (ch <= ' ')
+        {
+            BlitGlyph(row, stride, column, blank_glyph, color);
+            return;
+        }
+
+        if (ch < atlas_glyphs && glyph_atlas.present[ch])
+        {
+            BlitGlyph(row, stride, column, glyph_atlas.rows[ch].data(), color);
+            return;
+        }
+
+        // Everything else goes through ssfn, which never draws the background (bg is 0).
+        FillRect(row + column * cell_width * sizeof(u32), stride, cell_width, cell_height, bg);
+
+        ssfn_dst.ptr = row;
+        ssfn_dst.p = stride;
+        ssfn_dst.x = column * cell_width;
+        ssfn_dst.y = 0;
+        ssfn_dst.fg = color;
+        ssfn_putc(ch);
+    }
+
+    static void RenderRow(u32 row)
+    {
+        u8* pixels = ShadowRow(row);
+        const Cell* line = &cells[row * columns];
+
+        for (u32 x = 0; x < columns; x++)
+            DrawCell(pixels, ShadowStride(), x, line[x].ch, line[x].color);
+
+        // Pixels right of the last full column.
+        if (const u32 rest = width - columns * cell_width)
+            FillRect(pixels + columns * cell_width * sizeof(u32), ShadowStride(), rest, cell_height, bg);
+
+        render_pending[row] = false;
+    }
+
+    static void NewLine()
+    {
+        cursor_x = 0;
+
+        if (!shadow)
+        {
+            // Without a copy of the screen there is nothing to scroll with, wrap to the top instead.
+            cursor_y = cursor_y + 1 < rows ? cursor_y + 1 : 0;
+            FillRect(FrameBufferRow(cursor_y), pitch, width, cell_height, bg);
+            return;
+        }
+
+        if (cursor_y + 1 < rows)
+        {
+            cursor_y++;
+            return;
+        }
+
+        // The old top row becomes the new bottom row and every row on screen moved up.
+        const u32 row = top_row;
+        top_row = PhysicalRow(1);
+
+        memzero(&cells[row * columns], columns * sizeof(Cell));
+        render_pending[row] = true;
+        memset(copy_pending, true, rows);
+    }
+
+    static void PutCell(u32 ch)
+    {
+        if (!shadow)
+        {
+            DrawCell(FrameBufferRow(cursor_y), pitch, cursor_x, ch, fg);
+            return;
+        }
+
+        const u32 row = PhysicalRow(cursor_y);
+        cells[row * columns + cursor_x] = { ch, fg };
+        render_pending[row] = true;
+        copy_pending[cursor_y] = true;
+    }
+
+    void Write(const char* str)
+    {
+        auto s = ( char* )str;
+
+        while (*s)
+        {
+            const u32 ch = ssfn_utf8(&s);
+
+            switch (ch)
+            {
+            case '\n':
+                NewLine();
+                break;
+            case '\r':
+                cursor_x = 0;
+                break;
+            case '\t':
+                cursor_x = (cursor_x + tab_width) & ~(tab_width - 1);
+                break;
+            default:
+                if (cursor_x >= columns)
+                    NewLine();
+
+                PutCell(ch);
+                cursor_x++;
+                break;
+            }
+        }
+    }
+
+    void Flush()
+    {
+        if (!shadow)
+            return;
+
+        for (u32 row = 0; row < rows; row++)
+        {
+            if (render_pending[row])
+                RenderRow(row);
+        }
+
+        // Runs of changed screen rows go out in one copy, as long as they don't wrap around the ring.
+        for (u32 y = 0; y < rows;)
+        {
+            if (!copy_pending[y])
+            {
+                y++;
+                continue;
+            }
+
+            const u32 first = y;
+            do
+            {
+                copy_pending[y++] = false;
+            } while (y < rows && copy_pending[y] && PhysicalRow(y) != 0);
+
+            ke::StreamLines(
+                FrameBufferRow(first),
+                pitch,
+                ShadowRow(PhysicalRow(first)),
+                ShadowStride(),
+                ShadowStride(),
+                (y - first) * cell_height
+            );
+        }
+    }
+
+    void SetColor(u32 color)
+    {
+        fg = color;
+    }
+
+    void SetFrameBuffer(u64 address)
+    {
+        frame_buffer = ( u8* )address;
+    }
+
+    void EnableShadow()
+    {
+        const size_t shadow_size = ( size_t )rows * cell_height * ShadowStride();
+
+        cells = ke::Allocate<Cell>(rows * columns * sizeof(Cell), ke::pool_tag::console);
+        render_pending = ke::Allocate<bool>(rows, ke::pool_tag::console);
+        copy_pending = ke::Allocate<bool>(rows, ke::pool_tag::console);
+        auto pixels = ( u8* )ke::AllocateVirtual(shadow_size, ke::pool_tag::console, ke::AllocFlag::Uninitialized);
+
+        // The only time the framebuffer is read, to keep what was printed so far.
+        // Those rows have no cells, their pixels stay until the row is written again.
+        for (u32 y = 0; y < rows * cell_height; y++)
+            memcpy(pixels + y * ShadowStride(), frame_buffer + y * pitch, ShadowStride());
+
+        top_row = 0;
+        shadow = ( u32* )pixels;
+    }
+
+    EARLY void Initialize(const DisplayInfo& display)
+    {
+        frame_buffer = ( u8* )display.frame_buffer;
+        width = display.width;
+        height = display.height;
+        pitch = display.pitch;
+
+        ssfn_src = ( ssfn_font_t* )&FONT;
+        columns = width / cell_width;
+        rows = height / cell_height;
+
+        fg = BgrPixel(255, 255, 255).full;
+        bg = BgrPixel(0, 0, 0).full;
+
+        ssfn_dst.w = 0 - width; // Negative means ABGR
+        ssfn_dst.h = cell_height;
+        ssfn_dst.bg = 0;
+
+        FillRect(frame_buffer, pitch, width, height, bg);
+    }
+}
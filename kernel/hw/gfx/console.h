@@ -0,0 +1,32 @@
+#pragma once
+
+#include <base.h>
+
+#include "../../../boot/boot.h"
+
+//
+// Text console on top of the framebuffer.
+// Until EnableShadow is called glyphs are drawn straight into the framebuffer.
+// Afterwards text goes into a grid of character cells and a pixel shadow of the
+// screen in RAM, both rings of text rows so scrolling only moves an index.
+// Flush renders the changed rows and copies only the scanlines that changed on
+// screen. The framebuffer is only read once, when EnableShadow copies what is
+// already on screen into the shadow.
+// Nothing here locks. Write and Flush come from the core holding the output
+// (see AcquireOutput in output.cc) with interrupts disabled, the setup calls
+// from the boot processor during initialization.
+//
+namespace gfx::console
+{
+    EARLY void Initialize(const DisplayInfo& display);
+
+    // Needs the heap to be able to map pages, the shadow buffer is as large as the screen.
+    void EnableShadow();
+
+    void SetFrameBuffer(u64 address);
+    void SetColor(u32 color);
+
+    // UTF-8, doesn't reach the screen until Flush.
+    void Write(const char* str);
+    void Flush();
+}
@@ -1,24 +1,293 @@
 #include "output.h"
-
-#include "font.h"
-#define SSFN_CONSOLEBITMAP_TRUECOLOR
-#define SSFN_CONSOLEBITMAP_CONTROL
-#include "ssfn.h"
+#include "console.h"
 
 #include "../../core/ke.h"
+#include "../serial/serial.h"
+#include <libc/mem.h>
 #include <ec/string.h>
 
 namespace gfx
 {
+    //
+    // Once the log thread runs, Print formats with interrupts enabled and only appends
+    // the text to a lock-free ring: a bounded queue with a sequence number per slot,
+    // any number of producers (threads and interrupt handlers) and one consumer at a time.
+    // The log thread drains the ring in batches to the console and the serial port.
+    // Before that and after a panic, text is written out synchronously with interrupts disabled.
+    // Only the core holding the output (see AcquireOutput) writes to the console and serial port,
+    // so a panic on one core and the log thread on another take turns.
+    //
+    static constexpr size_t log_slot_count = 1024; // Power of two
+    static constexpr size_t log_slot_size = 64;
+    static constexpr u64 log_flush_interval = 10; // Timer ticks between batches
+
+    struct LogSlot
+    {
+        u64 sequence; // Position when free, position + 1 once filled
+        u32 length;
+        char text[log_slot_size - sizeof(u64) - sizeof(u32)];
+    };
+    static_assert(sizeof(LogSlot) == log_slot_size);
+
+    static constexpr size_t log_payload = sizeof(LogSlot::text);
+
+#pragma data_seg(".data")
+    static LogSlot* log_slots = nullptr;
+    static u64 log_enqueue_pos = 0;
+    static u64 log_dequeue_pos = 0;
+    static u64 log_dropped = 0;     // Messages that didn't fit into the ring
+    static u64 serial_dropped = 0;  // Bytes that didn't fit into the serial transmit ring
+    static bool log_async = false;
+    static bool log_paused = false; // The log thread leaves the ring alone, panics still drain it
+    static ke::Core* output_owner = nullptr;
+#pragma data_seg()
+
+    //
+    // Waits for the console and serial port, with interrupts disabled.
+    // It is held for one slot or message at a time, so a waiting core doesn't wait long.
+    // A core that panics while it holds them keeps them, so this returns false if the
+    // core already holds them and the caller must not release them.
+    //
+    static bool AcquireOutput()
+    {
+        // Only the boot processor runs before its core is set up.
+        if (!ke::core_initialized)
+            return false;
+
+        auto self = ke::GetCore();
+        if (__atomic_load_n(&output_owner, __ATOMIC_RELAXED) == self)
+            return false;
+
+        ke::Core* expected = nullptr;
+        while (!__atomic_compare_exchange_n(&output_owner, &expected, self, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+            expected = nullptr;
+            _mm_pause();
+        }
+
+        return true;
+    }
+
+    static void ReleaseOutput(bool acquired)
+    {
+        if (acquired)
+            __atomic_store_n(&output_owner, nullptr, __ATOMIC_RELEASE);
+    }
+
+    INLINE LogSlot& GetLogSlot(u64 pos)
+    {
+        return log_slots[pos & (log_slot_count - 1)];
+    }
+
+    // Slots are split at UTF-8 sequence boundaries so each one can be decoded on its own.
+    static size_t ChunkLength(const char* s, size_t length)
+    {
+        if (length <= log_payload)
+            return length;
+
+        size_t n = log_payload;
+        while (n > 1 && (s[n] & 0xc0) == 0x80)
+            n--;
+        return n;
+    }
+
+    static bool AppendLog(const char* s, size_t length)
+    {
+        u64 count = 0;
+        for (size_t n = 0; n < length; count++)
+            n += ChunkLength(s + n, length - n);
+
+        if (!count)
+            return true;
+        if (count > log_slot_count)
+            return false;
+
+        u64 pos = __atomic_load_n(&log_enqueue_pos, __ATOMIC_RELAXED);
+        for (;;)
+        {
+            // The consumer frees slots in order, if the last one is free all of them are.
+            const u64 last = pos + count - 1;
+            const auto diff = ( i64 )(__atomic_load_n(&GetLogSlot(last).sequence, __ATOMIC_ACQUIRE) - last);
+
+            if (diff < 0)
+                return false; // Full
+            if (diff > 0)
+                pos = __atomic_load_n(&log_enqueue_pos, __ATOMIC_RELAXED);
+            else if (__atomic_compare_exchange_n(&log_enqueue_pos, &pos, pos + count, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+
+        for (u64 i = 0; i < count; i++)
+        {
+            auto& slot = GetLogSlot(pos + i);
+            const size_t n = ChunkLength(s, length);
+
+            slot.length = n;
+            memcpy(slot.text, s, n);
+            __atomic_store_n(&slot.sequence, pos + i + 1, __ATOMIC_RELEASE);
+
+            s += n;
+            length -= n;
+        }
+
+        return true;
+    }
+
+    static void Emit(const char* s, bool to_serial = true)
+    {
+        console::Write(s);
+
+        const size_t length = strlen(s);
+        if (to_serial && serial::GetPort())
+        {
+            if (const size_t sent = serial::Send(s, length); sent < length)
+                __atomic_fetch_add(&serial_dropped, length - sent, __ATOMIC_RELAXED);
+        }
+    }
+
+    // Writes out one slot, false if the next one isn't filled yet.
+    static bool DrainSlot()
+    {
+        const bool prev = x64::DisableInterrupts();
+        const bool acquired = AcquireOutput();
+
+        auto& slot = GetLogSlot(log_dequeue_pos);
+        const bool paused = __atomic_load_n(&log_paused, __ATOMIC_ACQUIRE) && __atomic_load_n(&log_async, __ATOMIC_ACQUIRE);
+        const bool filled = !paused && __atomic_load_n(&slot.sequence, __ATOMIC_ACQUIRE) == log_dequeue_pos + 1;
+        if (filled)
+        {
+            char text[log_payload + 1];
+            memcpy(text, slot.text, slot.length);
+            text[slot.length] = '\0';
+            __atomic_store_n(&slot.sequence, log_dequeue_pos + log_slot_count, __ATOMIC_RELEASE);
+            log_dequeue_pos++;
+
+            Emit(text);
+        }
+
+        ReleaseOutput(acquired);
+        if (prev)
+            x64::EnableInterrupts();
+
+        return filled;
+    }
+
+    // s can be null to only flush the console.
+    static void EmitAndFlush(const char* s, bool to_serial = true)
+    {
+        const bool prev = x64::DisableInterrupts();
+        const bool acquired = AcquireOutput();
+
+        if (s)
+            Emit(s, to_serial);
+        console::Flush();
+
+        ReleaseOutput(acquired);
+        if (prev)
+            x64::EnableInterrupts();
+    }
+
+    // Consumers take turns a slot at a time, the log thread and panicking cores.
+    static bool DrainLog()
+    {
+        bool drained = false;
+
+        while (DrainSlot())
+            drained = true;
+
+        if (const u64 dropped = __atomic_exchange_n(&log_dropped, 0, __ATOMIC_RELAXED))
+        {
+            char notice[64]{};
+            snprintf(notice, sizeof notice, "[%llu messages dropped]\n", dropped);
+            EmitAndFlush(notice);
+            drained = true;
+        }
+
+        // Only on the console, the serial port would lose this notice too.
+        if (const u64 dropped = __atomic_exchange_n(&serial_dropped, 0, __ATOMIC_RELAXED))
+        {
+            char notice[64]{};
+            snprintf(notice, sizeof notice, "[%llu bytes dropped on serial]\n", dropped);
+            EmitAndFlush(notice, false);
+            drained = true;
+        }
+
+        return drained;
+    }
+
+    static void Output(const char* s)
+    {
+        if (__atomic_load_n(&log_async, __ATOMIC_ACQUIRE))
+        {
+            if (!AppendLog(s, strlen(s)))
+                __atomic_fetch_add(&log_dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+
+        EmitAndFlush(s);
+    }
+
+    // Waiting between batches lets messages collect, so a batch is worth a wakeup.
+    static int LogThread(u64)
+    {
+        __atomic_store_n(&log_async, true, __ATOMIC_RELEASE);
+
+        for (;;)
+        {
+            if (DrainLog())
+                EmitAndFlush(nullptr);
+
+            ke::Delay(log_flush_interval);
+        }
+
+        return 0;
+    }
+
+    void StartLogThread()
+    {
+        log_slots = ke::Allocate<LogSlot>(log_slot_count * sizeof(LogSlot), ke::pool_tag::print);
+        for (u64 i = 0; i < log_slot_count; i++)
+            log_slots[i].sequence = i;
+
+        // A low priority fair thread, it gets less time than normal threads under load but
+        // never starves. The ring holds what piles up meanwhile, anything past it is counted.
+        ke::CreateThread(LogThread, 0, { .policy = ke::SchedPolicy::Fair, .priority = ke::default_priority / 2 });
+    }
+
+    void StopLogThread()
+    {
+        _disable();
+
+        if (!__atomic_exchange_n(&log_async, false, __ATOMIC_ACQ_REL))
+            return;
+
+        // The log thread may still be writing out a slot on another core.
+        DrainLog();
+        EmitAndFlush(nullptr);
+    }
+
+    void PauseLog(bool paused)
+    {
+        __atomic_store_n(&log_paused, paused, __ATOMIC_RELEASE);
+
+        // The log thread may be writing out a slot right now, wait until it is done.
+        const bool prev = x64::DisableInterrupts();
+        ReleaseOutput(AcquireOutput());
+        if (prev)
+            x64::EnableInterrupts();
+    }
+
     void SetColor(u8 r, u8 g, u8 b)
     {
-        ssfn_dst.fg = BgrPixel(r, g, b).full;
+        console::SetColor(BgrPixel(r, g, b).full);
     }
 
+    static constexpr size_t heap_str_size = 2048;
+
     void Print(const char* fmt, ...)
     {
-        bool prev = x64::DisableInterrupts();
         char* s;
+        char* heap_str = nullptr;
 
         if (!ke::alloc_initialized)
         {
@@ -50,11 +319,10 @@ namespace gfx
 
             if (len == ec::umax_v<size_t>)
             {
-                ec::string heap_str;
-                heap_str.reserve(2048);
+                heap_str = ke::Allocate<char>(heap_str_size, ke::pool_tag::print);
 
                 va_start(copy, fmt);
-                len = vsnprintf(heap_str.data(), heap_str.capacity(), fmt, copy);
+                len = vsnprintf(heap_str, heap_str_size, fmt, copy);
                 va_end(copy);
 
                 if (len == ec::umax_v<size_t>)
@@ -65,7 +333,7 @@ namespace gfx
                 }
                 else
                 {
-                    s = heap_str.data();
+                    s = heap_str;
                 }
             }
             else
@@ -74,28 +342,29 @@ namespace gfx
             }
         }
 
-        while (*s)
-            ssfn_putc(ssfn_utf8(&s));
+        Output(s);
 
-        if (prev)
-            x64::EnableInterrupts();
+        ke::Free(heap_str, heap_str_size);
     }
 
     void PutChar(char c)
     {
-        bool prev = x64::DisableInterrupts();
-
-        char* s = &c;
-        while (*s)
-            ssfn_putc(ssfn_utf8(&s));
-
-        if (prev)
-            x64::EnableInterrupts();
+        const char str[]{ c, '\0' };
+        Output(str);
     }
 
     void SetFrameBufferAddress(u64 address)
     {
-        ssfn_dst.ptr = ( uint8_t* )address;
+        console::SetFrameBuffer(address);
+    }
+
+    void EnableConsoleShadow()
+    {
+        bool prev = x64::DisableInterrupts();
+        console::EnableShadow();
+
+        if (prev)
+            x64::EnableInterrupts();
     }
 
     static constexpr char k_keys[]{
@@ -130,30 +399,11 @@ namespace gfx
         const char c = map[key.code];
 
         if (key.code < size)
-            ssfn_putc(c);
+            PutChar(c);
     }
 
     EARLY void Initialize(const DisplayInfo& display)
     {
-        BgrPixel bg(0, 0, 0);
-
-        for (u32 x = 0; x < display.width; x++)
-        {
-            for (u32 y = 0; y < display.height; y++)
-            {
-                // TODO - should copy a whole buffer instead of doing inefficient loops
-                SetPixel(display, x, y, bg);
-            }
-        }
-
-        ssfn_src = ( ssfn_font_t* )&FONT;
-
-        ssfn_dst.ptr = ( uint8_t* )display.frame_buffer;
-        ssfn_dst.w = 0 - display.width; // Negative means ABGR
-        ssfn_dst.h = display.height;
-        ssfn_dst.p = display.pitch;
-        ssfn_dst.x = ssfn_dst.y = 0;
-        ssfn_dst.fg = BgrPixel(255, 255, 255).full;
-        ssfn_dst.bg = bg.full;
+        console::Initialize(display);
     }
 }
@@ -41,9 +41,21 @@ namespace gfx
     void SetColor(u8 r, u8 g, u8 b);
 
     void SetFrameBufferAddress(u64 address);
+    // Switches the console to the RAM shadow buffer, once the heap can grow.
+    void EnableConsoleShadow();
 
     void OnKey(const kbd::Key& key);
 
+    //
+    // Print only queues the text once StartLogThread was called, a log thread renders it later.
+    // StopLogThread writes out what is queued and makes output synchronous again, for panics.
+    // It returns with interrupts disabled.
+    //
+    void StartLogThread();
+    void StopLogThread();
+    // Holds queued messages back while something else needs the serial port to itself.
+    void PauseLog(bool paused);
+
     void Print(const char* fmt, ...);
     void PutChar(char c);
 
@@ -14,6 +14,10 @@ namespace kbd
         Release = 1 << 5,
     };
 
+    // Scan code set 2
+    static constexpr u8 key_f11 = 0x78; // Dumps the pool tags
+    static constexpr u8 key_f12 = 0x07; // Dumps the kernel trace
+
     struct Key
     {
         u8 code;
@@ -6,6 +6,7 @@
 #include "../cpu/x64.h"
 #include "../cpu/isr.h"
 #include "../gfx/output.h"
+#include "../../core/trace.h"
 
 namespace ps2
 {
@@ -159,7 +160,14 @@ namespace ps2
     {
         // Translate key and print to screen if valid
         kbd::Key key{};
-        if (kbd::HandleInput(x64::ReadPort8(port::data), key))
+        if (!kbd::HandleInput(x64::ReadPort8(port::data), key))
+            return;
+
+        if (key.code == kbd::key_f11)
+            ke::RequestPoolTagDump();
+        else if (key.code == kbd::key_f12)
+            ke::RequestTraceDump();
+        else
             gfx::OnKey(key);
     }
 
@@ -1,31 +1,120 @@
 #include <libc/print.h>
+#include <libc/str.h>
+#include <ec/util.h>
 
 #include "serial.h"
 #include "../cpu/x64.h"
 #include "../cpu/isr.h"
 #include "../gfx/output.h"
+#include "../../core/ke.h"
 
 #define SERIAL_STDIO 0
 
 namespace serial
 {
-    static u16 output_port;
-    static bool has_com1, has_com2;
+    static constexpr size_t tx_ring_size = KiB(4); // Power of two
+    static constexpr u32 poll_timeout = 10000; // IoDelay()s, far longer than a FIFO takes to empty
+
+#pragma data_seg(".data")
+    static u16 output_port = 0; // Print mirrors to it, it must be valid before Initialize
+    static u8 com1_fifo_size = 0; // 0 if the port is missing
+    static u8 com2_fifo_size = 0;
+
+    //
+    // Transmit ring, drained a FIFO at a time from the THRE interrupt.
+    // Until the first THRE interrupt arrives (the PIC is still masked during early boot)
+    // Send polls the ring out itself, see PollRing.
+    //
+    static char tx_ring[tx_ring_size]{};
+    static u32 tx_head = 0;
+    static u32 tx_tail = 0;
+    static u8 tx_fifo_size = 1;
+    static bool tx_busy = false;        // A THRE interrupt will follow
+    static bool tx_interrupts = false;  // THRE interrupts are being delivered
+    static ke::SpinLock tx_lock{};      // The ring and the transmitter, every core sends
+#pragma data_seg()
+
+    INLINE u8 ReadReg(u16 reg)
+    {
+        return x64::ReadPort8(output_port + reg);
+    }
+
+    //
+    // Refills the transmit FIFO, with tx_lock held.
+    // Returns true if a THRE interrupt is on its way.
+    //
+    static bool FillFifo()
+    {
+        if (!(ReadReg(reg::line_status) & ( u8 )LineStatus::EmptyTransmitReg))
+            return true;
+
+        u32 n = 0;
+        for (; n < tx_fifo_size && tx_tail != tx_head; n++)
+            x64::WritePort8(output_port + reg::data, tx_ring[tx_tail++ & (tx_ring_size - 1)]);
+
+        return n != 0;
+    }
 
     void Isr()
     {
-        char c = x64::ReadPort8(output_port);
-        if (c == '\r')
-            c = '\n';
+        // Bit 0 of IIR is clear while an interrupt is pending, bits 1-3 tell which one.
+        for (u8 iir; !((iir = ReadReg(reg::int_ident)) & 1);)
+        {
+            switch (( IntId )((iir >> 1) & 7))
+            {
+            case IntId::TransmitEmpty:
+                tx_lock.Acquire();
+                tx_interrupts = true;
+                tx_busy = FillFifo();
+                tx_lock.Release();
+                break;
+            case IntId::DataReady:
+            case IntId::Timeout:
+            {
+                char c = ReadReg(reg::data);
+                if (c == '\r')
+                    c = '\n';
 
-        PutChar(c); // Just send it to our framebuffer
+                PutChar(c); // Just send it to our framebuffer
 
 #if SERIAL_STDIO == 1
-        Write(output_port, reg::data, c); // Send to the console as well
+                Send(&c, 1); // Send to the console as well
 #endif
+                break;
+            }
+            case IntId::LineStatus:
+                ReadReg(reg::line_status);
+                break;
+            default:
+                ReadReg(reg::modem_status);
+                break;
+            }
+        }
     }
 
-    EARLY static bool InitializePort(u16 port)
+    static void WriteDivisor(u16 port, u16 divisor)
+    {
+        x64::WritePort8(port + reg::line_ctrl, ( u8 )Line::Dlab);
+        x64::WritePort8(port + reg::baud_divisor_low, LOW8(divisor));
+        x64::WritePort8(port + reg::baud_divisor_high, HIGH8(divisor));
+        x64::WritePort8(port + reg::line_ctrl, ( u8 )(Line::DataEight | Line::StopOne | Line::ParityNone));
+    }
+
+    bool SetBaudRate(u16 port, u32 baud)
+    {
+        if (!baud || baud > uart_clock || uart_clock % baud)
+            return false;
+
+        bool prev = x64::DisableInterrupts();
+        WriteDivisor(port, uart_clock / baud);
+
+        if (prev)
+            x64::EnableInterrupts();
+        return true;
+    }
+
+    // Returns the FIFO size, 0 if the port doesn't work.
+    EARLY static u8 InitializePort(u16 port)
     {
         auto write_reg = [port](u16 reg, u8 data)
         {
@@ -34,28 +123,14 @@ namespace serial
             x64::WritePort8(port + reg, data);
         };
 
-#if SERIAL_STDIO == 1
-        // Hardcode this to COM1 for now...
-        if (port == port::com1)
-        {
-            write_reg(reg::int_enabled, 1);
-            x64::ConnectIsr(Isr, 4);
-        }
-        else
-#endif
-        {
-            write_reg(reg::int_enabled, 0);
-        }
+        write_reg(reg::int_enabled, 0);
 
-        // Enable the Divisor Latch Access Bit and set divisor to 2 (57600 baud)
+        // The 64 byte FIFO enable bit of a 16750 can only be written while DLAB is set.
         write_reg(reg::line_ctrl, ( u8 )Line::Dlab);
-        write_reg(reg::baud_divisor_low, 2);
-        write_reg(reg::baud_divisor_high, 0);
-
-        // Clear DLAB and set up the rest
-        write_reg(reg::line_ctrl, ( u8 )(Line::DataEight | Line::StopOne | Line::ParityNone));
-        write_reg(reg::fifo_ctrl, ( u8 )(Fifo::Enable | Fifo::ClearReceive |
+        write_reg(reg::fifo_ctrl, ( u8 )(Fifo::Enable | Fifo::Enable64 | Fifo::ClearReceive |
             Fifo::ClearTransmit | Fifo::TriggerLvl4));
+        WriteDivisor(port, uart_clock / default_baud_rate);
+
         write_reg(reg::modem_ctrl, ( u8 )(Modem::DataReady | Modem::RequestSend | Modem::Loopback));
 
         // Test the port by verifying that we get the same value back
@@ -67,32 +142,65 @@ namespace serial
         if (x64::ReadPort8(port + reg::data) != 0xff)
         {
             Print("Serial: Port 0x%x returned an invalid response\n", port);
-            return false;
+            return 0;
         }
 
         // Test was successful, unset loopback again
         write_reg(reg::modem_ctrl, ( u8 )(Modem::DataReady | Modem::RequestSend));
-        return true;
+
+        // IIR bits 6-7 are set with a working FIFO (16550A and later), bit 5 with the 64 byte one.
+        // Larger FIFOs (16950) need chip specific detection and are used as 16 bytes.
+        const u8 iir = x64::ReadPort8(port + reg::int_ident);
+        if ((iir & 0xc0) != 0xc0)
+            return 1;
+
+        return iir & 0x20 ? 64 : 16;
     }
 
     EARLY void Initialize()
     {
         // Try to initialize COM1 and COM2.
         // TODO - Add support for finding more ports
-        has_com1 = InitializePort(port::com1);
-        has_com2 = InitializePort(port::com2);
+        com1_fifo_size = InitializePort(port::com1);
+        com2_fifo_size = InitializePort(port::com2);
         if (!SetPort(port::com1))
             Print("Serial port debugging unavailable.\n");
+        else
+            Print("Serial: COM%d, %d byte FIFO\n", output_port == port::com1 ? 1 : 2, tx_fifo_size);
     }
 
     bool SetPort(u16 port)
     {
-        if ((port == port::com1 && has_com1) || (port == port::com2 && has_com2))
+        const u8 fifo_size = port == port::com1 ? com1_fifo_size : port == port::com2 ? com2_fifo_size : 0;
+        if (!fifo_size)
+            return false;
+
+        Flush();
+
+        ke::SpinLockGuard guard(tx_lock);
+
+        if (output_port)
         {
-            output_port = port;
-            return true;
+            x64::WritePort8(output_port + reg::int_enabled, 0);
+            x64::WritePort8(output_port + reg::modem_ctrl, ( u8 )(Modem::DataReady | Modem::RequestSend));
         }
-        return false;
+
+        output_port = port;
+        tx_fifo_size = fifo_size;
+        tx_busy = false;
+        tx_interrupts = false;
+
+        // OUT2 gates the interrupt line on PC serial ports.
+        // THRE is raised right away with an empty FIFO, the first one switches Send to interrupts.
+        x64::ConnectIsr(Isr, port == port::com1 ? 4 : 3);
+        x64::WritePort8(port + reg::modem_ctrl, ( u8 )(Modem::DataReady | Modem::RequestSend | Modem::AuxOutput2));
+#if SERIAL_STDIO == 1
+        x64::WritePort8(port + reg::int_enabled, ( u8 )(IntEnable::DataReady | IntEnable::TransmitEmpty));
+#else
+        x64::WritePort8(port + reg::int_enabled, ( u8 )IntEnable::TransmitEmpty);
+#endif
+
+        return true;
     }
 
     u16 GetPort()
@@ -114,6 +222,70 @@ namespace serial
         x64::WritePort8(port + reg, data);
     }
 
+    //
+    // Sends the ring while THRE interrupts don't arrive, a FIFO load at a time so interrupts
+    // are only disabled briefly. If the transmitter stays busy for poll_timeout, or the
+    // interrupt never comes because the IRQ isn't wired, the rest waits in the ring.
+    // Flush or the first THRE interrupt sends it, and Send drops what doesn't fit.
+    //
+    static void PollRing()
+    {
+        for (u32 waited = 0; waited < poll_timeout;)
+        {
+            bool sent = false;
+            {
+                ke::SpinLockGuard guard(tx_lock);
+                if (tx_interrupts || tx_tail == tx_head)
+                    return;
+
+                if (ReadReg(reg::line_status) & ( u8 )LineStatus::EmptyTransmitReg)
+                    sent = FillFifo();
+            }
+
+            if (sent)
+            {
+                waited = 0;
+            }
+            else
+            {
+                x64::IoDelay();
+                waited++;
+            }
+        }
+    }
+
+    size_t Send(const char* data, size_t length)
+    {
+        if (!output_port)
+            return 0;
+
+        bool polling;
+        {
+            ke::SpinLockGuard guard(tx_lock);
+
+            length = ec::min(length, tx_ring_size - (tx_head - tx_tail));
+            for (size_t i = 0; i < length; i++)
+                tx_ring[tx_head++ & (tx_ring_size - 1)] = data[i];
+
+            polling = !tx_interrupts;
+            if (!polling && !tx_busy)
+                tx_busy = FillFifo();
+        }
+
+        if (polling)
+            PollRing();
+
+        return length;
+    }
+
+    void Flush()
+    {
+        ke::SpinLockGuard guard(tx_lock);
+
+        while (tx_tail != tx_head)
+            Write(output_port, reg::data, tx_ring[tx_tail++ & (tx_ring_size - 1)]);
+    }
+
     void Write(const char* fmt, ...)
     {
         char str[512]{};
@@ -122,8 +294,6 @@ namespace serial
         vsnprintf(str, sizeof str, fmt, ap);
         va_end(ap);
 
-        const char* s = str;
-        while (*s)
-            Write(output_port, reg::data, *s++);
+        Send(str, strlen(str));
     }
 }
@@ -49,6 +49,24 @@ namespace serial
         AutoflowCtrl = 1 << 5
     };
 
+    enum_flags(IntEnable, u8)
+    {
+        DataReady = 1 << 0,
+        TransmitEmpty = 1 << 1,
+        LineStatus = 1 << 2,
+        ModemStatus = 1 << 3
+    };
+
+    // Bits 1-3 of the interrupt identification register.
+    enum class IntId : u8
+    {
+        ModemStatus = 0,
+        TransmitEmpty = 1,
+        DataReady = 2,
+        LineStatus = 3,
+        Timeout = 6
+    };
+
     enum class LineStatus
     {
         DataReady = 1 << 0,
@@ -73,7 +91,8 @@ namespace serial
         static constexpr u16 int_enabled = 1;       // DLAB = 0
         static constexpr u16 baud_divisor_low = 0;  // DLAB = 1
         static constexpr u16 baud_divisor_high = 1; // DLAB = 1
-        static constexpr u16 fifo_ctrl = 2;
+        static constexpr u16 fifo_ctrl = 2;         // Write
+        static constexpr u16 int_ident = 2;         // Read
         static constexpr u16 line_ctrl = 3;
         static constexpr u16 modem_ctrl = 4;
         static constexpr u16 line_status = 5;
@@ -81,6 +100,10 @@ namespace serial
         static constexpr u16 scratch = 7;
     }
 
+    // The divisor latch counts in units of this rate.
+    static constexpr u32 uart_clock = 115200;
+    static constexpr u32 default_baud_rate = 115200;
+
     EARLY void Initialize();
 
     // Default is COM1.
@@ -88,7 +111,20 @@ namespace serial
     bool SetPort(u16 port);
     u16 GetPort();
 
+    // Baud must divide uart_clock.
+    bool SetBaudRate(u16 port, u32 baud);
+
+    // Raw register access, polls the line status first.
     u8 Read(u16 port, u16 reg = reg::data);
     void Write(u16 port, u16 reg, u8 data);
+
+    //
+    // Queues data for the output port and returns right away, the THRE interrupt sends it.
+    // Until THRE interrupts work it polls the data out, with interrupts as the caller had them.
+    // Returns how much was queued, the rest is dropped when the ring is full.
+    //
+    size_t Send(const char* data, size_t length);
+    // Polls out everything queued, for panics and before switching ports.
+    void Flush();
     void Write(const char* str, ...);
 }
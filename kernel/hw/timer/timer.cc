@@ -3,6 +3,7 @@
 #include "../cpu/isr.h"
 #include "../cmos/cmos.h"
 #include "../gfx/output.h"
+#include "../../core/ke.h"
 
 namespace timer
 {
@@ -23,9 +24,98 @@ namespace timer
         }
     }
 
+    // Every core refreshes the ticks from the main counter, whichever one is still ticking.
+    static void UpdateTicks()
+    {
+        const u64 now = hpet::ElapsedTicks();
+        u64 prev = ticks;
+        while (prev < now && !__atomic_compare_exchange_n(&ticks, &prev, now, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            EMPTY_STMT;
+    }
+
+    // A single interrupt leaves the timer off, the idle core waits for its next expiry.
+    static void RearmStoppedTick()
+    {
+        if (ke::GetCore()->tick_stopped)
+            StopTick(ke::NextTimerExpiry());
+    }
+
     void Isr()
     {
-        ticks++;
+        // The main counter keeps time while the tick is stopped.
+        if (hpet::registers)
+            UpdateTicks();
+        else
+            ticks++;
+
+        ke::UpdateClock();
+        ke::ExpireTimers();
+        ke::SchedulerTick();
+
+        if (ke::core_initialized)
+            RearmStoppedTick();
+    }
+
+    void LocalIsr()
+    {
+        // Without the HPET the boot core keeps ticking for everyone.
+        if (hpet::registers)
+            UpdateTicks();
+
+        ke::ExpireTimers();
+        ke::SchedulerTick();
+        RearmStoppedTick();
+    }
+
+    bool StopTick(u64 deadline)
+    {
+        auto core = ke::GetCore();
+        if (!core->index && !hpet::legacy_routing)
+            return false;
+
+        if (hpet::registers)
+            UpdateTicks();
+
+        // Nothing to gain when the next tick is due anyway.
+        const u64 now = ticks;
+        if (deadline <= now + 1)
+        {
+            StartTick();
+            return false;
+        }
+
+        deadline = ec::min(deadline, now + max_tickless_ticks);
+        if (core->index)
+        {
+            apic::SetLocalOneShot(deadline - now);
+        }
+        else if (!hpet::SetOneShot(hpet::start_count + deadline * hpet::counts_per_tick))
+        {
+            hpet::SetPeriodic();
+            core->tick_stopped = false;
+            return false;
+        }
+
+        core->tick_stopped = true;
+        return true;
+    }
+
+    void StartTick()
+    {
+        auto core = ke::GetCore();
+        if (!core->tick_stopped)
+            return;
+
+        core->tick_stopped = false;
+
+        // The thread about to run may read them, no core might have ticked in a while.
+        if (hpet::registers)
+            UpdateTicks();
+
+        if (core->index)
+            apic::SetLocalPeriodic();
+        else
+            hpet::SetPeriodic();
     }
 }
 
@@ -42,6 +132,26 @@ namespace timer::pit
         x64::WritePort8(port::data0, LOW8(divisor));
         x64::WritePort8(port::data0, HIGH8(divisor));
     }
+
+    EARLY void StartCountdown(u16 count)
+    {
+        // Raise the gate with the speaker disconnected, the count starts once it is written.
+        x64::WritePort8(port::gate, (x64::ReadPort8(port::gate) & ~0x02) | 0x01);
+
+        const auto channel = ( u8 )Channel::Two;
+        const auto access = ( u8 )Access::LowHigh;
+        const auto mode = ( u8 )Mode::IntOnTerminalCount;
+        const auto bcd_binary = ( u8 )BcdBinary::Binary;
+
+        x64::WritePort8(port::ctrl, channel | access | mode | bcd_binary);
+        x64::WritePort8(port::data2, LOW8(count));
+        x64::WritePort8(port::data2, HIGH8(count));
+    }
+
+    EARLY bool CountdownDone()
+    {
+        return x64::ReadPort8(port::gate) & 0x20;
+    }
 }
 
 namespace timer::hpet
@@ -50,8 +160,6 @@ namespace timer::hpet
     {
         // TODO - accessing registers in Release builds hangs the system
         auto regs = ( volatile Registers* )hpet_address;
-        auto time = regs->tick_period / hz;
-        auto period = ( u64 )regs->counter + time;
 
         // general[12:8] is the highest timer # counting from 0.
         u32 timer_count = EXTRACT64(regs->general, 8, 12) + 1;
@@ -60,21 +168,51 @@ namespace timer::hpet
             auto& timer = regs->timers[i];
             if (timer.general & TmrPeriodicSupport)
             {
-                // Enable timer and set to periodic
-                timer.general = ( TimerConfig )(timer.general |
-                    TmrEnable | TmrPeriodic | TmrSetAccumulator);
+                // Legacy replacement routes timer 0 to IRQ 0 in place of the PIT,
+                // the only routing that works with the PIC.
+                legacy_routing = i == 0 && (regs->general & FeatLegacyReplacement);
 
-                // Also enable HPET here
-                regs->config = ( Config )(regs->config | CfgEnable);
-
-                // Reset counter and set the comparator and accumulator
+                // Reset the counter while it is stopped
+                regs->config = ( Config )(regs->config & ~CfgEnable);
                 regs->counter = 0;
-                timer.comparator = ( u64 )regs->tick_period + period;
-                timer.comparator = period;
+
+                registers = regs;
+                tick_timer = i;
+                counts_per_tick = Frequency() / hz;
+                start_count = 0;
+                SetPeriodic();
+
+                // Also enable HPET here
+                regs->config = ( Config )(regs->config | CfgEnable | (legacy_routing ? CfgLegacyReplacement : 0));
                 return true;
             }
         }
 
         return false;
     }
+
+    void SetPeriodic()
+    {
+        auto& timer = registers->timers[tick_timer];
+
+        // Stay on the tick grid, the next interrupt lands on the next whole tick.
+        const u64 now = ReadCounter();
+        const u64 next = now - (now - start_count) % counts_per_tick + counts_per_tick;
+
+        // With the accumulator bit set the first write sets the comparator, the second one the period.
+        timer.general = ( TimerConfig )(timer.general | TmrEnable | TmrPeriodic | TmrSetAccumulator);
+        timer.comparator = next;
+        timer.comparator = counts_per_tick;
+    }
+
+    bool SetOneShot(u64 comparator)
+    {
+        auto& timer = registers->timers[tick_timer];
+
+        timer.general = ( TimerConfig )((timer.general & ~TmrPeriodic) | TmrEnable);
+        timer.comparator = comparator;
+
+        // The interrupt fires when the counter equals the comparator, one already passed never fires.
+        return ( i64 )(comparator - ReadCounter()) > 0;
+    }
 }
@@ -9,9 +9,23 @@ namespace timer
     inline volatile u64 seconds = 0;
 #pragma data_seg()
 
+    // Longest the tick stays off, ke::UpdateClock needs an interrupt every few seconds.
+    static constexpr u64 max_tickless_ticks = 1000;
+
     EARLY void Initialize(u64 hpet_address);
 
     void Isr();
+    // Tick of the other cores from their local APIC timer.
+    void LocalIsr();
+
+    //
+    // Tickless idle on the calling core. StopTick replaces its periodic interrupt with
+    // a single one at the given tick, StartTick goes back to periodic. Both run with
+    // interrupts disabled. The boot core needs the HPET routed to IRQ 0 for this,
+    // StopTick returns false when the tick keeps running.
+    //
+    bool StopTick(u64 deadline);
+    void StartTick();
 
     namespace pit
     {
@@ -53,12 +67,17 @@ namespace timer
             static constexpr u16 data1 = 0x41;
             static constexpr u16 data2 = 0x42;
             static constexpr u16 ctrl = 0x43;
+            static constexpr u16 gate = 0x61; // Channel 2 gate in bit 0, its output in bit 5
         }
 
         static constexpr u32 clock_rate = 1193182;
         static constexpr u16 divisor = clock_rate / 1000;
 
         EARLY void Initialize();
+
+        // Channel 2 counts down once, without interrupts. Used for calibration.
+        EARLY void StartCountdown(u16 count);
+        EARLY bool CountdownDone();
     }
 
     namespace hpet
@@ -120,7 +139,38 @@ namespace timer
 #pragma pack()
 
         static constexpr u32 hz = 1000;
+        static constexpr u64 femtoseconds = 1'000'000'000'000'000;
+
+#pragma data_seg(".data")
+        // Set once the main counter runs.
+        inline volatile Registers* registers = nullptr;
+        inline u64 counts_per_tick = 0;
+        inline u64 start_count = 0;     // Main counter at tick 0
+        inline u32 tick_timer = 0;      // Comparator driving the tick
+        inline bool legacy_routing = false; // Timer 0 raises IRQ 0
+#pragma data_seg()
 
         EARLY bool Initialize(u64 hpet_address);
+
+        INLINE u64 ReadCounter()
+        {
+            return registers->counter;
+        }
+
+        // Whole ticks since Initialize, also right after the tick was stopped.
+        INLINE u64 ElapsedTicks()
+        {
+            return (ReadCounter() - start_count) / counts_per_tick;
+        }
+
+        void SetPeriodic();
+        // False if the counter already passed the comparator.
+        bool SetOneShot(u64 comparator);
+
+        // Main counter frequency in Hz, tick_period is in femtoseconds.
+        INLINE u64 Frequency()
+        {
+            return femtoseconds / registers->tick_period;
+        }
     }
 }
@@ -0,0 +1,147 @@
+#pragma once
+
+#include "../base.h"
+#include "util.h"
+
+namespace ec
+{
+    // Links of a node in an avl tree, embedded in the node like list_entry.
+    template<class T>
+    struct avl_entry
+    {
+        T* left;
+        T* right;
+        i32 height;
+    };
+
+    //
+    // Intrusive AVL tree. The tree is only its root pointer, every operation takes
+    // a subtree and returns the subtree that replaces it. Nothing is allocated or
+    // freed here. Policy tells where a node keeps its links and how nodes compare:
+    //   static avl_entry<T>& entry(T* node);
+    //   static bool less(const T* a, const T* b);  Equal nodes go right of each other
+    //   static void update(T* node);               Recomputes what a node caches about its subtree
+    // Walks that need more than the order, like searching by some other key,
+    // recurse themselves and call balance on the way back up.
+    //
+    template<class T, class Policy>
+    struct avl
+    {
+        INLINE static T*& left(T* node)
+        {
+            return Policy::entry(node).left;
+        }
+
+        INLINE static T*& right(T* node)
+        {
+            return Policy::entry(node).right;
+        }
+
+        INLINE static i32 height(T* node)
+        {
+            return node ? Policy::entry(node).height : 0;
+        }
+
+        // After a child changed, for changes that keep the heights.
+        static void update(T* node)
+        {
+            Policy::entry(node).height = 1 + max(height(left(node)), height(right(node)));
+            Policy::update(node);
+        }
+
+        static T* balance(T* node)
+        {
+            update(node);
+
+            const auto factor = height(left(node)) - height(right(node));
+            if (factor > 1)
+            {
+                if (height(left(left(node))) < height(right(left(node))))
+                    left(node) = rotate_left(left(node));
+                return rotate_right(node);
+            }
+
+            if (factor < -1)
+            {
+                if (height(right(right(node))) < height(left(right(node))))
+                    right(node) = rotate_right(right(node));
+                return rotate_left(node);
+            }
+
+            return node;
+        }
+
+        static T* insert(T* root, T* node)
+        {
+            if (!root)
+            {
+                left(node) = right(node) = nullptr;
+                update(node);
+                return node;
+            }
+
+            if (Policy::less(node, root))
+                left(root) = insert(left(root), node);
+            else
+                right(root) = insert(right(root), node);
+
+            return balance(root);
+        }
+
+        static T* detach_min(T* root, T*& min)
+        {
+            if (!left(root))
+            {
+                min = root;
+                return right(root);
+            }
+
+            left(root) = detach_min(left(root), min);
+            return balance(root);
+        }
+
+        // Unlinks the root of a subtree, its successor takes its place.
+        static T* remove(T* root)
+        {
+            auto l = left(root);
+            auto r = right(root);
+
+            if (!r)
+                return l;
+
+            T* min;
+            r = detach_min(r, min);
+            left(min) = l;
+            right(min) = r;
+            return balance(min);
+        }
+
+        static T* leftmost(T* root)
+        {
+            while (root && left(root))
+                root = left(root);
+            return root;
+        }
+
+    private:
+        static T* rotate_right(T* node)
+        {
+            auto l = left(node);
+            left(node) = right(l);
+            right(l) = node;
+            update(node);
+            update(l);
+            return l;
+        }
+
+        static T* rotate_left(T* node)
+        {
+            auto r = right(node);
+            right(node) = left(r);
+            left(r) = node;
+            update(node);
+            update(r);
+            return r;
+        }
+    };
+}
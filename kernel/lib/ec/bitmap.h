@@ -29,6 +29,150 @@ namespace ec
             return this->size() * bits_per_member;
         }
 
+        //
+        // Bulk operations.
+        // These work on whole members at a time and only mask the first and last one.
+        // Searches look at [from, limit) and return npos if nothing was found.
+        //
+
+        constexpr void set_range(size_t first, size_t count)
+        {
+            update_range(first, count, true);
+        }
+
+        constexpr void clear_range(size_t first, size_t count)
+        {
+            update_range(first, count, false);
+        }
+
+        constexpr size_t find_first_clear(size_t from = 0, size_t limit = N * bits_per_member) const
+        {
+            for (size_t i = from / bits_per_member; i * bits_per_member < limit; i++)
+            {
+                T free = ( T )~this->m_data[i];
+                if (i == from / bits_per_member)
+                    free &= head_mask(from % bits_per_member);
+
+                if (free)
+                {
+                    const size_t bit = i * bits_per_member + ctz(free);
+                    return bit < limit ? bit : npos;
+                }
+            }
+
+            return npos;
+        }
+
+        constexpr size_t find_clear_run(size_t count, size_t from = 0, size_t limit = N * bits_per_member) const
+        {
+            size_t run = 0, start = from;
+
+            for (size_t b = from; b < limit;)
+            {
+                const size_t offset = b % bits_per_member;
+                const size_t avail = min(bits_per_member - offset, limit - b);
+
+                // Used bits in this member, shifted so that bit 0 is b.
+                T used = ( T )(this->m_data[b / bits_per_member] >> offset);
+                if (avail < bits_per_member)
+                    used &= ( T )~head_mask(avail);
+
+                if (!used)
+                {
+                    // The whole remainder of this member is free.
+                    if (count - run <= avail)
+                        return start;
+                    run += avail;
+                    b += avail;
+                    continue;
+                }
+
+                const size_t zeros = ctz(used);
+                if (count - run <= zeros)
+                    return start;
+
+                // Skip the used bits and restart the run after them.
+                const T rest = ( T )~(used >> zeros);
+                const size_t ones = rest ? min(ctz(rest), avail - zeros) : avail - zeros;
+                b += zeros + ones;
+                start = b;
+                run = 0;
+            }
+
+            return npos;
+        }
+
+        //
+        // Next fit: searches from the hint to the limit, then wraps around
+        // and searches from the start up to where the first pass began.
+        //
+        constexpr size_t find_clear_run_next_fit(size_t count, size_t hint, size_t limit = N * bits_per_member) const
+        {
+            if (hint >= limit)
+                hint = 0;
+
+            const auto bit = find_clear_run(count, hint, limit);
+            if (bit != npos || !hint)
+                return bit;
+
+            return find_clear_run(count, 0, min(hint + count - 1, limit));
+        }
+
         static constexpr auto bits_per_member = sizeof(T) * 8;
+        static constexpr size_t npos = ~0ULL;
+
+    private:
+        static constexpr T all_set = ( T )~T{};
+
+        static constexpr size_t min(size_t a, size_t b)
+        {
+            return a < b ? a : b;
+        }
+
+        static constexpr size_t ctz(T x)
+        {
+            return __builtin_ctzll(( u64 )x);
+        }
+
+        // Bits [shift, bits_per_member) set.
+        static constexpr T head_mask(size_t shift)
+        {
+            return ( T )(all_set << shift);
+        }
+
+        // Bits [0, bit] set.
+        static constexpr T tail_mask(size_t bit)
+        {
+            return ( T )(all_set >> (bits_per_member - 1 - bit));
+        }
+
+        constexpr void update_range(size_t first, size_t count, bool set)
+        {
+            if (!count)
+                return;
+
+            const size_t last = first + count - 1;
+            size_t i = first / bits_per_member;
+            const size_t end = last / bits_per_member;
+
+            auto apply = [this, set](size_t index, T mask)
+            {
+                if (set)
+                    this->m_data[index] |= mask;
+                else
+                    this->m_data[index] &= ( T )~mask;
+            };
+
+            if (i == end)
+            {
+                apply(i, head_mask(first % bits_per_member) & tail_mask(last % bits_per_member));
+                return;
+            }
+
+            apply(i++, head_mask(first % bits_per_member));
+            for (; i < end; i++)
+                this->m_data[i] = set ? all_set : T{};
+            apply(end, tail_mask(last % bits_per_member));
+        }
     };
-}
\ No newline at end of file
+}
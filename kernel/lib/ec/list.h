@@ -4,75 +4,163 @@
 
 #define CONTAINING_RECORD(x, t, f) (( t* )(( char* )(x) - OFFSET(t, f)))
 
+// Every link change checks its neighbours, a corrupted list traps with an invalid opcode.
+// #define EC_LIST_DEBUG
+
+#ifdef EC_LIST_DEBUG
+#define EC_LIST_CHECK(x) do { if (!(x)) __builtin_trap(); } while (0)
+#else
+#define EC_LIST_CHECK(x) EMPTY_STMT
+#endif
+
 namespace ec
 {
-    struct slist_entry
+    //
+    // Intrusive circular doubly-linked list, like LIST_ENTRY on Windows.
+    // The head is a list_entry of its own that links to itself while the list is
+    // empty, it has to be set up with init() first. Entries are unlinked (null)
+    // while they are on no list.
+    //
+    struct list_entry
     {
-        static INLINE size_t size(slist_entry* head)
+        INLINE void init()
         {
-            size_t size = 0;
+            m_next = m_prev = this;
+        }
 
-            for (auto p = head; p && p->m_next != head; p = p->m_next)
-                size++;
+        INLINE bool empty() const
+        {
+            return m_next == this;
+        }
 
-            return size;
+        INLINE bool linked() const
+        {
+            return m_next;
         }
 
-        INLINE void push(slist_entry* entry)
+        INLINE list_entry* front() const
         {
-            if (!m_next)
-            {
-                m_next = entry;
-                m_next->m_next = m_next;
-            }
-            else
-            {
-                auto temp = m_next;
-                while (temp->m_next != m_next)
-                    temp = temp->m_next;
-                entry->m_next = m_next;
-                temp->m_next = entry;
-                m_next = entry;
-            }
+            return empty() ? nullptr : m_next;
         }
 
-        INLINE auto pop()
+        INLINE list_entry* back() const
         {
-            if (!m_next)
-                return;
+            return empty() ? nullptr : m_prev;
+        }
 
-            if (m_next->m_next == m_next)
-            {
-                m_next = nullptr;
-            }
-            else
-            {
-                auto temp = m_next;
-                while (temp->m_next != m_next)
-                    temp = temp->m_next;
-                temp->m_next = m_next->m_next;
-                m_next = m_next->m_next;
-            }
+        INLINE void insert_after(list_entry* entry)
+        {
+            EC_LIST_CHECK(!entry->linked());
+            EC_LIST_CHECK(m_next->m_prev == this);
+
+            entry->m_prev = this;
+            entry->m_next = m_next;
+            m_next->m_prev = entry;
+            m_next = entry;
+        }
+
+        INLINE void insert_before(list_entry* entry)
+        {
+            m_prev->insert_after(entry);
+        }
+
+        // On a head, the ends of the list.
+        INLINE void push_front(list_entry* entry)
+        {
+            insert_after(entry);
+        }
+
+        INLINE void push_back(list_entry* entry)
+        {
+            insert_before(entry);
         }
 
-        INLINE void remove(slist_entry* entry)
+        // Unlinks this entry from whatever list it is on.
+        INLINE void remove()
         {
-            auto p1 = this;
-            auto p2 = m_next;
+            EC_LIST_CHECK(linked());
+            EC_LIST_CHECK(m_prev->m_next == this && m_next->m_prev == this);
 
-            while (p2)
+            m_prev->m_next = m_next;
+            m_next->m_prev = m_prev;
+            m_next = m_prev = nullptr;
+        }
+
+        INLINE list_entry* pop_front()
+        {
+            auto entry = front();
+            if (entry)
+                entry->remove();
+            return entry;
+        }
+
+        INLINE list_entry* pop_back()
+        {
+            auto entry = back();
+            if (entry)
+                entry->remove();
+            return entry;
+        }
+
+        // Moves every entry of another head to the end of this list, leaving it empty.
+        INLINE void splice(list_entry* head)
+        {
+            if (head->empty())
+                return;
+
+            EC_LIST_CHECK(m_prev->m_next == this);
+            EC_LIST_CHECK(head->m_next->m_prev == head && head->m_prev->m_next == head);
+
+            auto first = head->m_next;
+            auto last = head->m_prev;
+
+            first->m_prev = m_prev;
+            m_prev->m_next = first;
+            last->m_next = this;
+            m_prev = last;
+
+            head->init();
+        }
+
+        list_entry* m_next{};
+        list_entry* m_prev{};
+    };
+
+    //
+    // Typed iteration over the entries of a list:
+    //  for (auto thread : list_range<Thread, OFFSET(Thread, thread_list_entry)>(&head))
+    // The entry being visited may be removed.
+    //
+    template<typename T, size_t Offset>
+    struct list_range
+    {
+        struct iterator
+        {
+            iterator(list_entry* entry)
+                : m_entry(entry), m_next(entry->m_next)
             {
-                if (p2 == entry)
-                {
-                    p1->m_next = p2->m_next;
-                    return;
-                }
-
-                p1 = p1->m_next;
-                p2 = p2->m_next;
             }
+
+            bool operator==(const iterator& rhs) const { return m_entry == rhs.m_entry; }
+            iterator& operator++() { m_entry = m_next; m_next = m_entry->m_next; return *this; }
+            T* operator*() const { return ( T* )(( char* )m_entry - Offset); }
+
+        private:
+            list_entry* m_entry;
+            list_entry* m_next;
+        };
+
+        list_range(list_entry* head)
+            : m_head(head)
+        {
         }
 
-        slist_entry* m_next{};
+        iterator begin() const { return m_head->m_next; }
+        iterator end() const { return m_head; }
+
+    private:
+        list_entry* m_head;
     };
 }
+
+#define LIST_RANGE(head, t, f) ec::list_range<t, OFFSET(t, f)>(head)
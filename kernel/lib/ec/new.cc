@@ -11,17 +11,32 @@ void* operator new[](size_t size)
     return ke::Allocate(size);
 }
 
+void* operator new(size_t size, u32 tag)
+{
+    return ke::Allocate(size, tag);
+}
+
+void* operator new[](size_t size, u32 tag)
+{
+    return ke::Allocate(size, tag);
+}
+
 void operator delete(void* address)
 {
     ke::Free(address);
 }
 
-void operator delete(void* address, [[maybe_unused]] size_t size)
+void operator delete(void* address, size_t size)
 {
-    ke::Free(address);
+    ke::Free(address, size);
 }
 
 void operator delete[](void* address)
 {
     ke::Free(address);
 }
+
+void operator delete[](void* address, size_t size)
+{
+    ke::Free(address, size);
+}
@@ -4,6 +4,10 @@
 
 void* operator new(size_t size);
 void* operator new[](size_t size);
+// Charged to a ke::PoolTag.
+void* operator new(size_t size, u32 tag);
+void* operator new[](size_t size, u32 tag);
 void operator delete(void* address);
 void operator delete(void* address, size_t size);
 void operator delete[](void* address);
+void operator delete[](void* address, size_t size);
@@ -181,7 +181,7 @@ namespace ec
             return *this;
 
         // Switch to the heap (or expand)
-        auto new_buffer = new char[new_cap];
+        auto new_buffer = new (pool_tag) char[new_cap];
         auto cur_length = length();
 
         strlcpy(new_buffer, data(), cur_length + 1);
@@ -316,13 +316,14 @@ namespace ec
                 return;
             }
 
-            m_long.buffer = new char[length + 1];
+            m_long.buffer = new (pool_tag) char[length + 1];
             m_long.buffer[length] = '\0';
             m_long.length = length;
             m_long.capacity = length + 1;
         }
 
         static constexpr size_t max_local_cap = 23;
+        static constexpr u32 pool_tag = 'S' | 't' << 8 | 'r' << 16 | 'g' << 24; // ke::pool_tag::string
 
         union
         {
@@ -39,6 +39,18 @@ namespace ec
         b = tmp;
     }
 
+    template<class T>
+    constexpr const T& min(const T& a, const T& b)
+    {
+        return b < a ? b : a;
+    }
+
+    template<class T>
+    constexpr const T& max(const T& a, const T& b)
+    {
+        return a < b ? b : a;
+    }
+
     constexpr bool is_consteval()
     {
         return __builtin_is_constant_evaluated();
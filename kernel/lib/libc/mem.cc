@@ -1,5 +1,22 @@
 #include "mem.h"
 
+//
+// Without SSE the widest moves are 8 bytes. The generic routines align the
+// destination first and then copy or fill a qword at a time.
+// On CPUs with ERMS (and FSRM for short lengths) a plain rep movsb/stosb is
+// faster than any loop, the microcode picks the widest internal moves itself.
+//
+
+typedef u64 __attribute__((aligned(1), may_alias)) unaligned_u64;
+
+// ERMS has a startup cost that only pays off for longer strings, unless FSRM is also present.
+static constexpr size_t erms_threshold = 128;
+
+#pragma data_seg(".data")
+static bool fast_strings = false;       // ERMS
+static bool fast_short_strings = false; // FSRM
+#pragma data_seg()
+
 EXTERN_C_START
 
 #ifdef COMPILER_MSVC
@@ -8,11 +25,45 @@ EXTERN_C_START
 #pragma function(memset)
 #endif
 
+void SetMemoryFeatures(bool erms, bool fsrm)
+{
+    fast_strings = erms;
+    fast_short_strings = erms && fsrm;
+}
+
+INLINE bool UseStringOps(size_t n)
+{
+    return n >= erms_threshold ? fast_strings : fast_short_strings;
+}
+
+INLINE void RepMovsb(u8* d, const u8* s, size_t n)
+{
+    asm volatile("rep movsb" : "+D"(d), "+S"(s), "+c"(n) : : "memory");
+}
+
+INLINE void RepStosb(u8* d, u8 val, size_t n)
+{
+    asm volatile("rep stosb" : "+D"(d), "+c"(n) : "a"(val) : "memory");
+}
+
 int memcmp(const void* buf1, const void* buf2, size_t n)
 {
     const u8* a = ( const u8* )buf1;
     const u8* b = ( const u8* )buf2;
 
+    // repe cmpsb is slow everywhere, compare qwords and find the first different byte.
+    for (; n >= sizeof(u64); n -= sizeof(u64), a += sizeof(u64), b += sizeof(u64))
+    {
+        const u64 x = *( const unaligned_u64* )a;
+        const u64 y = *( const unaligned_u64* )b;
+
+        if (x != y)
+        {
+            const auto shift = __builtin_ctzll(x ^ y) & ~7;
+            return ( u8 )(x >> shift) < ( u8 )(y >> shift) ? -1 : 1;
+        }
+    }
+
     while (n--) {
         if (*a++ != *b++)
             return a[-1] < b[-1] ? -1 : 1;
@@ -26,16 +77,81 @@ void* memcpy(void* dst, const void* src, size_t n)
     u8* d = ( u8* )dst;
     const u8* s = ( const u8* )src;
 
+    if (UseStringOps(n))
+    {
+        RepMovsb(d, s, n);
+        return dst;
+    }
+
+    if (n >= sizeof(u64))
+    {
+        // Head bytes until the destination is aligned, the source may stay unaligned.
+        for (; ( uptr_t )d & (sizeof(u64) - 1); n--)
+            *d++ = *s++;
+
+        for (; n >= sizeof(u64); n -= sizeof(u64), d += sizeof(u64), s += sizeof(u64))
+            *( u64* )d = *( const unaligned_u64* )s;
+    }
+
     while (n--)
         *d++ = *s++;
 
     return dst;
 }
 
+void* memmove(void* dst, const void* src, size_t n)
+{
+    u8* d = ( u8* )dst;
+    const u8* s = ( const u8* )src;
+
+    // A forward copy is safe unless the destination starts inside the source.
+    if (( uptr_t )d - ( uptr_t )s >= n)
+        return memcpy(dst, src, n);
+
+    // Copy backwards, aligning the end of the destination first.
+    d += n;
+    s += n;
+
+    if (n >= sizeof(u64))
+    {
+        for (; ( uptr_t )d & (sizeof(u64) - 1); n--)
+            *--d = *--s;
+
+        for (; n >= sizeof(u64); n -= sizeof(u64))
+        {
+            d -= sizeof(u64);
+            s -= sizeof(u64);
+            *( u64* )d = *( const unaligned_u64* )s;
+        }
+    }
+
+    while (n--)
+        *--d = *--s;
+
+    return dst;
+}
+
 void* memset(void* dst, u32 val, size_t n)
 {
     u8* d = ( u8* )dst;
 
+    if (UseStringOps(n))
+    {
+        RepStosb(d, ( u8 )val, n);
+        return dst;
+    }
+
+    if (n >= sizeof(u64))
+    {
+        const u64 pattern = ( u8 )val * 0x0101010101010101ULL;
+
+        for (; ( uptr_t )d & (sizeof(u64) - 1); n--)
+            *d++ = ( u8 )val;
+
+        for (; n >= sizeof(u64); n -= sizeof(u64), d += sizeof(u64))
+            *( u64* )d = pattern;
+    }
+
     while (n--)
         *d++ = ( u8 )val;
 
@@ -6,8 +6,12 @@ EXTERN_C_START
 
 int memcmp(const void* buf1, const void* buf2, size_t n);
 void* memcpy(void* dst, const void* src, size_t n);
+void* memmove(void* dst, const void* src, size_t n);
 void* memset(void* dst, u32 val, size_t n);
 
+// Enables rep movsb/stosb based on the CPUID ERMS and FSRM bits.
+void SetMemoryFeatures(bool erms, bool fsrm);
+
 EXTERN_C_END
 
 #define memzero(dst, n) memset(dst, 0, n)
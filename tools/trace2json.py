@@ -0,0 +1,131 @@
+#!/usr/bin/env python3
+#
+# Converts a kernel trace dump (press F12, see kernel/core/trace.h) from a serial
+# log into the Chrome trace event format. Open the result in chrome://tracing
+# or https://ui.perfetto.dev.
+#
+# usage: trace2json.py serial_qemu.txt [out.json]
+#
+
+import json
+import sys
+
+CONTEXT_SWITCH, IRQ_ENTER, IRQ_EXIT, SYSCALL, ALLOCATE, FREE, WAKEUP = range(7)
+
+
+def tag_name(tag):
+    return tag.to_bytes(4, "little").decode("ascii", "replace")
+
+
+def parse_dumps(lines):
+    dump = None
+    for line in lines:
+        line = line.strip()
+        if line.startswith("#TRACE BEGIN"):
+            fields = line.split()[2:]
+            dump = {"info": dict(zip(fields[::2], fields[1::2])), "records": []}
+        elif line.startswith("#TRACE END") and dump:
+            yield dump
+            dump = None
+        elif line.startswith("#T ") and dump:
+            tsc, kind, thread, a, b, c = line.split()[1:]
+            dump["records"].append((int(tsc, 16), int(kind), int(thread), int(a, 16), int(b, 16), int(c, 16)))
+
+
+def convert(dump, start):
+    info = dump["info"]
+    tsc_hz = int(info.get("tsc_hz", 0))
+    if tsc_hz:
+        cycles_per_us = tsc_hz / 1e6
+    else:
+        # Uncalibrated TSC, estimate its rate from the timer ticks.
+        ticks = int(info["now_ticks"]) - int(info["ticks"])
+        cycles = int(info["now_tsc"], 16) - int(info["tsc"], 16)
+        if ticks <= 0 or cycles <= 0:
+            sys.exit("trace2json: dump has no time base")
+        cycles_per_us = cycles / (ticks * 1e6 / int(info["hz"]))
+    core = int(info["core"])
+    records = sorted(dump["records"])
+
+    def us(tsc):
+        return (tsc - start) / cycles_per_us
+
+    events = [
+        {"ph": "M", "name": "process_name", "pid": core, "args": {"name": f"core {core}"}},
+        {"ph": "M", "name": "thread_name", "pid": core, "tid": 0, "args": {"name": "threads"}},
+        {"ph": "M", "name": "thread_name", "pid": core, "tid": 1, "args": {"name": "irq"}},
+        {"ph": "M", "name": "thread_name", "pid": core, "tid": 2, "args": {"name": "events"}},
+    ]
+
+    running = None  # (thread, start tsc)
+    live_bytes = 0
+    sizes = {}
+
+    def end_running(ts):
+        if running:
+            events.append({"ph": "X", "name": f"thread {running[0]}", "pid": core, "tid": 0,
+                           "ts": us(running[1]), "dur": ts - us(running[1])})
+
+    for tsc, kind, thread, a, b, c in records:
+        ts = us(tsc)
+
+        if kind == CONTEXT_SWITCH:
+            end_running(ts)
+            running = (b, tsc)
+        elif kind == IRQ_ENTER:
+            events.append({"ph": "B", "name": f"irq {a}", "pid": core, "tid": 1, "ts": ts})
+        elif kind == IRQ_EXIT:
+            events.append({"ph": "E", "name": f"irq {a}", "pid": core, "tid": 1, "ts": ts})
+        elif kind == SYSCALL:
+            events.append({"ph": "i", "s": "t", "name": f"syscall {a}", "pid": core, "tid": 2, "ts": ts,
+                           "args": {"thread": thread, "rip": hex(b)}})
+        elif kind == ALLOCATE:
+            sizes[b] = c
+            live_bytes += c
+            events.append({"ph": "i", "s": "t", "name": "alloc", "pid": core, "tid": 2, "ts": ts,
+                           "args": {"thread": thread, "tag": tag_name(a), "address": hex(b), "size": c}})
+            events.append({"ph": "C", "name": "heap", "pid": core, "ts": ts, "args": {"traced bytes": live_bytes}})
+        elif kind == FREE:
+            # Frees of allocations made before the ring's oldest record have no known size.
+            live_bytes -= sizes.pop(b, 0)
+            events.append({"ph": "i", "s": "t", "name": "free", "pid": core, "tid": 2, "ts": ts,
+                           "args": {"thread": thread, "address": hex(b)}})
+            events.append({"ph": "C", "name": "heap", "pid": core, "ts": ts, "args": {"traced bytes": live_bytes}})
+        elif kind == WAKEUP:
+            events.append({"ph": "i", "s": "t", "name": f"wakeup {a}", "pid": core, "tid": 2, "ts": ts,
+                           "args": {"late ticks": b}})
+
+    # The last thread is still running at the end of the dump.
+    if records:
+        end_running(us(records[-1][0]))
+
+    return events
+
+
+def main():
+    if len(sys.argv) < 2:
+        sys.exit(__doc__ or "usage: trace2json.py serial_log [out.json]")
+
+    with open(sys.argv[1], errors="replace") as f:
+        dumps = list(parse_dumps(f))
+    if not dumps:
+        sys.exit("trace2json: no trace dump found")
+
+    # Every core writes its own dump, the last one of each wins, earlier ones are
+    # usually overlapping snapshots. The TSC is shared, so one start lines them up.
+    latest = {}
+    for dump in dumps:
+        latest[dump["info"]["core"]] = dump
+    start = min((min(d["records"])[0] for d in latest.values() if d["records"]), default=0)
+
+    events = []
+    for core in sorted(latest, key=int):
+        events += convert(latest[core], start)
+    trace = {"traceEvents": events, "displayTimeUnit": "ns"}
+
+    out = open(sys.argv[2], "w") if len(sys.argv) > 2 else sys.stdout
+    json.dump(trace, out)
+
+
+if __name__ == "__main__":
+    main()